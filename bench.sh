@@ -0,0 +1,68 @@
+#!/bin/bash
+
+set -o errexit
+set -o nounset
+set -o pipefail
+
+enable -f ./ini.so ini ini_diff
+
+ini_file=$(mktemp)
+trap 'rm -f "$ini_file"' EXIT
+
+# 1000 sections of 100 keys each
+for ((s = 0; s < 1000; s++)); do
+	printf '[section%d]\n' "$s"
+	for ((k = 0; k < 100; k++)); do
+		printf 'key%d = value%d\n' "$k" "$k"
+	done
+done >"$ini_file"
+
+TIMEFORMAT='%3R s'
+
+function count-triples() {
+	((triples += $# / 3))
+}
+
+printf '## ini -C, 100000 keys by callback quantum\n'
+for quantum in 1 10 100 1000 5000 100000; do
+	triples=0
+	printf 'quantum %6d: ' "$quantum"
+	{ time ini -C count-triples -c "$quantum" <"$ini_file"; } 2>&1
+done
+
+printf '\n## ini -a, 100000 short keys\n'
+printf 'parse: '
+{ time ini -a short <"$ini_file"; } 2>&1
+
+printf '\n## ini_diff, 100000 keys, one value changed\n'
+ini -a changed <"$ini_file"
+changed_section500[key50]=changed
+printf 'diff: '
+{ time ini_diff short changed changes; } 2>&1
+
+printf '\n## ini -a, 100000 keys compressed, in process and through a pipe\n'
+gzip -c "$ini_file" >"$ini_file.gz"
+trap 'rm -f "$ini_file" "$ini_file".*' EXIT
+printf 'gzip in process: '
+{ time ini -a gz -f "$ini_file.gz"; } 2>&1
+printf 'gzip | zcat:     '
+{ time ini -a gz < <(zcat "$ini_file.gz"); } 2>&1
+if type -P zstd >/dev/null; then
+	zstd -q -c "$ini_file" >"$ini_file.zst"
+	printf 'zstd in process: '
+	{ time ini -a zst -f "$ini_file.zst"; } 2>&1
+	printf 'zstd | zstdcat:  '
+	{ time ini -a zst < <(zstd -q -d -c "$ini_file.zst"); } 2>&1
+fi
+
+# A value of 2^n MiB should take about twice the time of 2^(n-1) MiB
+printf '\n## ini -a, one long value by size\n'
+for mib in 1 2 4 8 16; do
+	{
+		printf '[blob]\ndata = '
+		head -c $((mib * 1024 * 1024)) /dev/zero | tr '\0' 'x'
+		printf '\n'
+	} >"$ini_file"
+	printf '%2d MiB: ' "$mib"
+	{ time ini -a long <"$ini_file"; } 2>&1
+done
@@ -3,8 +3,25 @@
 #include "shell.h"
 #include "bashgetopt.h"
 #include "common.h"
+#include "ini_builtins.h"
+#include <ctype.h>
+#include <dirent.h>
+#include <dlfcn.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <sys/stat.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 
 char *ini_doc[] = {
     "Reads an INI config from stdin input into a set of associative arrays.",
@@ -37,105 +54,3365 @@ char *ini_doc[] = {
     "If the `-u FD` argument is passed the INI config is read from the `FD`",
     "file descriptor rather than from stdin. Variables are created with local",
     "scope inside a function unless the `-g` option is specified.",
+    "",
+    "Input compressed with gzip or zstd, found from its first bytes, is",
+    "decompressed as it is read, a block at a time, so `ini -f conf.ini.gz`",
+    "needs neither a `zcat` process nor the whole decompressed config in",
+    "memory. This holds for every input, including `-D` directories, `-n`",
+    "and `!include` directives, when ini.so was built with zlib and libzstd.",
+    "",
+    "With the `-F` option no per section arrays are created, every key and",
+    "value is instead added to the single `TOC` associative array under the",
+    "key `<INI_SECTION_NAME><SEP>key`. `SEP` defaults to `.` and may be set",
+    "with `-s SEP`. Section names need not be valid Bash variable names in",
+    "this mode, and keys before the first section are added without a prefix.",
+    "",
+    "Associative arrays iterate in hash order. The `-o` option additionally",
+    "creates the indexed array `<TOC>__order` listing the section names, or",
+    "the flat keys with `-F`, in file order, and for each section the indexed",
+    "array `<TOC>_<INI_SECTION_NAME>__keys` listing its keys in file order.",
+    "",
+    "With `-C FUNC` no arrays are created and `-a` may be omitted. The shell",
+    "function `FUNC` is instead called with batches of section, key and value",
+    "triples as its arguments, `QUANTUM` triples at a time, 5000 unless set",
+    "with `-c QUANTUM`. This bounds memory use by the quantum rather than by",
+    "the size of the config. A callback returning non-zero ends the parse and",
+    "its status is returned.",
+    "",
+    "Values may be converted to integers once at parse time. `-T SEC.KEY=int`",
+    "types a key as an integer and may be repeated; a value of a typed key",
+    "that is not a decimal or 0x prefixed hexadecimal integer is an error.",
+    "With `-I` every value that is an integer is converted. Converted values",
+    "are added, in canonical decimal form, to the integer attributed",
+    "associative array `<TOC>_<INI_SECTION_NAME>__int`, or `<TOC>__int` with",
+    "`-F`, alongside the string values.",
+    "",
+    "With `-S SCHEMA` every key is validated against the schema INI file",
+    "`SCHEMA`, whose keys declare the keys of the config as",
+    "`key = TYPE [MIN..MAX] [required]`. `TYPE` is one of `string`, `int` or",
+    "`bool`, the optional range bounds an integer's value or a string's",
+    "length. Keys that are unknown, of the wrong type or out of range, and",
+    "required keys that are missing, are all added to the indexed array",
+    "`<TOC>__errors`, or the array named by `-e ERRORS`, rather than stopping",
+    "at the first one. A schema is compiled once and reused until its file",
+    "changes.",
+    "",
+    "With `-f FILE` the config is read from `FILE` rather than from a file",
+    "descriptor, and with `-D DIR` from the `.ini` files in `DIR` in name",
+    "order. Both may be repeated, the files are then parsed in turn into the",
+    "same arrays.",
+    "",
+    "With `-n` the `-f` and `-D` files are only checked, on a thread per CPU,",
+    "and no arrays are made. Syntax errors, section names that would not make",
+    "valid variable names, prefixed by `TOC` if `-a` is given, and keys",
+    "outside of a section are reported for every file as `FILE:LINE: ERROR`,",
+    "carrying on past the first error. The errors are added to the indexed",
+    "array `ERRORS` if `-e ERRORS` is given and are printed otherwise.",
+    "",
+    "With `-m` indented lines continue the value of the key above them and",
+    "are joined to it with newlines. A value enclosed in double or single",
+    "quotes loses them, and the escapes `\\n`, `\\t`, `\\r`, `\\\\`, `\\\"`,",
+    "`\\'` and `\\;` are decoded, any other backslash is kept. `\\;` keeps a",
+    "`;` after whitespace from starting a comment.",
+    "",
+    "With `-O` the files are layered, e.g. `-f defaults.ini -f site.ini",
+    "-f host.ini -O`. They are all parsed before any array is made, a key in",
+    "a later file replaces the value from an earlier one and every key is",
+    "bound once. With `-p PROV` the associative array `PROV` records the",
+    "file each key came from, indexed by `<SECTION><SEP><KEY>`, where `SEP` is",
+    "the `-s` separator.",
+    "",
+    "A line `!include PATH` parses the file `PATH` in its place, and a line",
+    "`!include_dir DIR` the `.ini` files in `DIR` in name order. Relative",
+    "paths are resolved against the directory of the including file. A file",
+    "is parsed once however often it is included, and a file including",
+    "itself, directly or not, is an error.",
+    "",
+    "With `-R` a value may refer to another key as `${SECTION:KEY}` or to a",
+    "shell variable as `${VAR}`, and `$$` is a literal `$`. The references",
+    "are replaced once every file is parsed, so a key may refer to one",
+    "further down, and `-R` implies `-O`. Each key is resolved once, and",
+    "keys referring to each other in a cycle are an error.",
+    "",
+    "With `-i` a section `[CHILD : PARENT, ...]` is named `CHILD` and has the",
+    "keys of its parents that it does not set itself, the first parent",
+    "listed taking precedence. Parents may inherit in turn, and `-i` implies",
+    "`-O` since a parent may come later or from another file.",
+    "",
+    "With `-l SEC.KEY` the value of a key is also made a list, the indexed",
+    "array `<TOC>_<SEC>_<KEY>`, and with `-r` so are keys written `KEY[]`,",
+    "every line of which adds to the list of `KEY`. With `-d DELIM` list",
+    "values are split on any of the characters of `DELIM`, with the items",
+    "trimmed and empty ones dropped. The section array keeps the value as",
+    "written under `KEY`, for `KEY[]` the last one. A `KEY = value` line",
+    "that is repeated replaces the list, as it does the value. A list whose",
+    "array would have the name of a section array is an error.",
+    "",
+    "With `-M` a section name that would make an illegal variable name,",
+    "such as `[web-01.example.com]`, is not an error: every character that",
+    "cannot be in a variable name is made `_`, so the keys of that section",
+    "go to `<TOC>_web_01_example_com`. The TOC is then keyed by the mangled",
+    "names and its values are the names as written in the config, rather",
+    "than `true`. Two sections mangled to the same name are an error, rather",
+    "than merged.",
+    "",
+    "With `-L` section and key names are lowercased. With `-k GLOB` only",
+    "keys whose name matches the glob are kept, and with `-K GLOB` keys whose",
+    "name matches it are dropped, both may be given several times and `-K`",
+    "wins over `-k`. Globs see the names after `-L`, and keys are filtered as",
+    "inih hands them over, before anything is copied or bound, so a dropped",
+    "key costs only its scan. Sections are kept even when all their keys are",
+    "dropped.",
+    "",
+    "With `-x` every key is also exported as the variable",
+    "`PREFIX_SECTION_KEY`, in upper case and with anything but letters and",
+    "digits made `_`. `-P PREFIX` sets the prefix, without it the names",
+    "start with the section. `-a` is optional with `-x`. With `-E` a",
+    "variable of that name that was already exported overrides the value in",
+    "the config, both for the export and in the arrays.",
+    "",
+    "With `-H HASH` the associative array `HASH` gets two 64 bit XXH64",
+    "hashes, in hex, computed during the parse: `HASH[input]` of the bytes",
+    "read, included files and all, each file hashed on its own so that",
+    "`ini_wait -H` gives the same hash, and `HASH[content]` of the keys and",
+    "values bound. The content hash does not depend on the order of the",
+    "sections and keys, nor on comments, spacing or keys that were set again",
+    "later, so it only changes when the parsed config does. Without arrays,",
+    "with `-C` or with `-x` alone, every key read counts.",
+    "",
+    "With `-t` the parse is a transaction. The TOC, the arrays named after",
+    "it and the `-p` and `-H` arrays are made under shadow names and only",
+    "replace the arrays they are named for once the whole config parsed",
+    "without error. After an error the shadow arrays are removed and the",
+    "previous arrays are left as they were, so a reload never leaves a",
+    "partly updated config behind.",
+    "",
+    "With `-A JOBID` the input is read and tokenized on a thread while the",
+    "script carries on, and `ini` returns at once. Only the input options",
+    "are given to `ini -A`, `ini_wait JOBID` then takes the other options",
+    "and makes the arrays from the tokens, e.g.",
+    "",
+    "    $ ini -A big -f big.ini",
+    "    $ ...",
+    "    $ ini_wait big -a conf",
+    "",
+    "Errors in the input are reported by `ini_wait`, except a file that",
+    "does not exist, the paths are resolved by `ini -A` so a `cd` before",
+    "`ini_wait` does not change them. Every job must be waited for, a job",
+    "ID may be reused once it was.",
+    NULL};
+
+char *ini_wait_doc[] = {
+    "Makes the arrays of an `ini -A` job.",
+    "",
+    "Waits for the thread of the `ini -A JOBID` job to finish reading its",
+    "input, then makes the arrays from the tokens it read, with the options",
+    "of `ini` other than those for the input. See `help ini`.",
+    "",
+    "In a subshell the job can only be waited for if its thread was done",
+    "before the subshell started, otherwise `ini_wait` fails.",
     NULL};
 
-/* User data for inih callback handler */
-typedef struct {
-  char *toc_var_name;
-  bool local_vars;
-} ini_conf;
+/* The value types a schema may declare */
+typedef enum { SCHEMA_STRING, SCHEMA_INT, SCHEMA_BOOL } schema_type;
+
+/* A key declared by a schema, `<key> = <type> [MIN..MAX] [required]` */
+typedef struct {
+  char *section;
+  char *name;
+  schema_type type;
+  bool has_min;
+  bool has_max;
+  intmax_t min; /* Bounds the value of an int, or the length of a string */
+  intmax_t max;
+  bool required;
+} schema_key;
+
+/* A compiled schema. Keys are found through a perfect hash: a key's first hash
+ * picks a bucket, and the bucket's displacement seeds a second hash that maps
+ * every key of the bucket to its own slot. A lookup is then two hashes and a
+ * single key comparison */
+typedef struct ini_schema {
+  struct ini_schema *next;
+  dev_t dev; /* Identifies the schema file for the cache */
+  ino_t ino;
+  struct timespec mtime;
+  off_t size;
+  schema_key *keys;
+  size_t len;
+  size_t *slots; /* Index into keys, or SIZE_MAX for an empty slot */
+  size_t slots_len;
+  uint64_t *disp;
+  size_t buckets;
+  bool failed;
+} ini_schema;
+
+/* The displacements tried per bucket before the table is grown */
+#define SCHEMA_MAX_DISP (1 << 16)
+
+/* Schemas compiled by this shell, reused until their file changes */
+static ini_schema *schema_cache = NULL;
+
+/* XXH64, https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md */
+#define XXH_PRIME1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME3 0x165667B19E3779F9ULL
+#define XXH_PRIME4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME5 0x27D4EB2F165667C5ULL
+
+/* The state of a streaming XXH64 hash, seeded with 0 */
+typedef struct {
+  uint64_t acc[4];
+  uint64_t total;
+  unsigned char mem[32]; /* Input short of a whole 32 byte stripe */
+  size_t mem_len;
+} xxh_state;
+
+static uint64_t xxh_rotl(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+/* Reads 8 or 4 bytes little endian, so hashes are the same on every host */
+static uint64_t xxh_read(const unsigned char *p, int n) {
+  uint64_t v = 0;
+  for (int i = n - 1; i >= 0; i--) {
+    v = (v << 8) | p[i];
+  }
+  return v;
+}
+
+static uint64_t xxh_round(uint64_t acc, uint64_t input) {
+  acc += input * XXH_PRIME2;
+  return xxh_rotl(acc, 31) * XXH_PRIME1;
+}
+
+static void xxh_init(xxh_state *state) {
+  memset(state, 0, sizeof(*state));
+  state->acc[0] = XXH_PRIME1 + XXH_PRIME2;
+  state->acc[1] = XXH_PRIME2;
+  state->acc[3] = -XXH_PRIME1;
+}
+
+static void xxh_stripe(xxh_state *state, const unsigned char *p) {
+  for (int i = 0; i < 4; i++) {
+    state->acc[i] = xxh_round(state->acc[i], xxh_read(p + 8 * i, 8));
+  }
+}
+
+static void xxh_update(xxh_state *state, const void *input, size_t len) {
+  const unsigned char *p = input;
+  state->total += len;
+  if (state->mem_len + len < 32) {
+    memcpy(state->mem + state->mem_len, p, len);
+    state->mem_len += len;
+    return;
+  }
+  if (state->mem_len) {
+    size_t take = 32 - state->mem_len;
+    memcpy(state->mem + state->mem_len, p, take);
+    xxh_stripe(state, state->mem);
+    p += take;
+    len -= take;
+    state->mem_len = 0;
+  }
+  for (; len >= 32; p += 32, len -= 32) {
+    xxh_stripe(state, p);
+  }
+  memcpy(state->mem, p, len);
+  state->mem_len = len;
+}
+
+static uint64_t xxh_digest(const xxh_state *state) {
+  uint64_t h;
+  if (state->total >= 32) {
+    h = xxh_rotl(state->acc[0], 1) + xxh_rotl(state->acc[1], 7) +
+        xxh_rotl(state->acc[2], 12) + xxh_rotl(state->acc[3], 18);
+    for (int i = 0; i < 4; i++) {
+      h ^= xxh_round(0, state->acc[i]);
+      h = h * XXH_PRIME1 + XXH_PRIME4;
+    }
+  } else {
+    h = XXH_PRIME5;
+  }
+  h += state->total;
+  const unsigned char *p = state->mem;
+  size_t len = state->mem_len;
+  for (; len >= 8; p += 8, len -= 8) {
+    h ^= xxh_round(0, xxh_read(p, 8));
+    h = xxh_rotl(h, 27) * XXH_PRIME1 + XXH_PRIME4;
+  }
+  if (len >= 4) {
+    h ^= xxh_read(p, 4) * XXH_PRIME1;
+    h = xxh_rotl(h, 23) * XXH_PRIME2 + XXH_PRIME3;
+    p += 4;
+    len -= 4;
+  }
+  for (; len; p++, len--) {
+    h ^= *p * XXH_PRIME5;
+    h = xxh_rotl(h, 11) * XXH_PRIME1;
+  }
+  h ^= h >> 33;
+  h *= XXH_PRIME2;
+  h ^= h >> 29;
+  h *= XXH_PRIME3;
+  h ^= h >> 32;
+  return h;
+}
+
+/* Hashes a number as 8 bytes little endian */
+static void xxh_update_u64(xxh_state *state, uint64_t v) {
+  unsigned char bytes[8];
+  for (int i = 0; i < 8; i++) {
+    bytes[i] = v >> (8 * i);
+  }
+  xxh_update(state, bytes, 8);
+}
+
+/* The block size of the reads from the file descriptor */
+#define READ_BUF_SIZE (64 * 1024)
+
+/* The read buffer of the top level file, it is kept for the next call of the
+ * builtin. Included files, and an `ini` run by a `-C` callback while this
+ * one is in use, have their own */
+static char *read_buf;
+static bool read_buf_busy;
+
+/* The compression of the input, found from its first bytes */
+typedef enum { CODEC_UNKNOWN, CODEC_NONE, CODEC_GZIP, CODEC_ZSTD } codec;
+
+/* A file descriptor read by `read_line` */
+typedef struct {
+  int fd;
+  char *buf;
+  size_t pos; /* The first byte of `buf` not yet returned */
+  size_t len; /* The bytes read into `buf` */
+  bool eof;
+  int error;       /* The errno of a failed read */
+  const char *decode_error; /* Why compressed input could not be read */
+  codec codec;
+  char *raw; /* Compressed input, decompressed into `buf` */
+  size_t raw_pos;
+  size_t raw_len;
+  bool raw_eof;
+  bool frame_done; /* The last compressed stream or frame is complete */
+#ifdef HAVE_ZLIB
+  z_stream *gzip;
+#endif
+#ifdef HAVE_ZSTD
+  ZSTD_DStream *zstd;
+#endif
+  bool line_start; /* The next byte returned starts a line */
+  bool indented;   /* The line being parsed starts with whitespace */
+  int lineno;
+  /* Runs a `!` directive line, the line is then passed to inih as blank */
+  bool (*directive)(void *user, char *line);
+  void *user;
+  bool failed; /* A directive failed, so the parse stops */
+  xxh_state *hash; /* `-H`, hashes every byte read from the file */
+} fd_reader;
+
+/* Reads from the file descriptor into `buf`, retrying on EINTR */
+static ssize_t read_fd(int fd, char *buf, size_t size) {
+  ssize_t got;
+  while ((got = read(fd, buf, size)) < 0 && errno == EINTR) {
+  }
+  return got;
+}
+
+/* Starts decompressing gzip or zstd input, whose first `len` bytes are in
+ * `buf`. This may run on an `ini -A` thread, so it only uses malloc(3) */
+static bool start_decoder(fd_reader *reader, size_t len) {
+  reader->raw = malloc(READ_BUF_SIZE);
+  if (!reader->raw) {
+    reader->decode_error = strerror(ENOMEM);
+    return false;
+  }
+  memcpy(reader->raw, reader->buf, len);
+  reader->raw_len = len;
+  if (reader->codec == CODEC_GZIP) {
+#ifdef HAVE_ZLIB
+    reader->gzip = calloc(1, sizeof(z_stream));
+    /* 32 accepts both gzip and zlib headers */
+    if (reader->gzip && inflateInit2(reader->gzip, 15 + 32) == Z_OK) {
+      return true;
+    }
+    free(reader->gzip);
+    reader->gzip = NULL;
+    reader->decode_error = strerror(ENOMEM);
+#else
+    reader->decode_error = "gzip input, but ini.so was built without zlib";
+#endif
+    return false;
+  }
+#ifdef HAVE_ZSTD
+  reader->zstd = ZSTD_createDStream();
+  if (reader->zstd && !ZSTD_isError(ZSTD_initDStream(reader->zstd))) {
+    return true;
+  }
+  reader->decode_error = strerror(ENOMEM);
+#else
+  reader->decode_error = "zstd input, but ini.so was built without libzstd";
+#endif
+  return false;
+}
+
+/* Decompresses what it can of the raw input into `buf`. Returns the bytes
+ * decompressed, or -1 for corrupt input */
+static ssize_t decode(fd_reader *reader) {
+  size_t in_len = reader->raw_len - reader->raw_pos;
+#ifdef HAVE_ZLIB
+  if (reader->gzip) {
+    z_stream *zs = reader->gzip;
+    /* Concatenated gzip members are read one after the other, as by zcat */
+    if (reader->frame_done && in_len) {
+      inflateReset(zs);
+      reader->frame_done = false;
+    }
+    zs->next_in = (unsigned char *)reader->raw + reader->raw_pos;
+    zs->avail_in = in_len;
+    zs->next_out = (unsigned char *)reader->buf;
+    zs->avail_out = READ_BUF_SIZE;
+    int ret = inflate(zs, Z_NO_FLUSH);
+    reader->raw_pos = reader->raw_len - zs->avail_in;
+    if (ret == Z_STREAM_END) {
+      reader->frame_done = true;
+    } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+      reader->decode_error = zs->msg ? zs->msg : "corrupt gzip input";
+      return -1;
+    }
+    return READ_BUF_SIZE - zs->avail_out;
+  }
+#endif
+#ifdef HAVE_ZSTD
+  if (reader->zstd) {
+    ZSTD_inBuffer in = {reader->raw, reader->raw_len, reader->raw_pos};
+    ZSTD_outBuffer out = {reader->buf, READ_BUF_SIZE, 0};
+    size_t ret = ZSTD_decompressStream(reader->zstd, &out, &in);
+    bool progress = out.pos || in.pos > reader->raw_pos;
+    reader->raw_pos = in.pos;
+    if (ZSTD_isError(ret)) {
+      reader->decode_error = ZSTD_getErrorName(ret);
+      return -1;
+    }
+    /* Called again with no input, it asks for the header of a next frame */
+    if (progress) {
+      reader->frame_done = ret == 0;
+    }
+    return out.pos;
+  }
+#endif
+  (void)in_len;
+  return -1;
+}
+
+/* Reads the next block of the input into `buf`, decompressing gzip and zstd
+ * input in place of `zcat`. Returns the bytes read, 0 at the end of the
+ * input or -1 on an error */
+static ssize_t read_input(fd_reader *reader) {
+  if (reader->codec == CODEC_NONE) {
+    return read_fd(reader->fd, reader->buf, READ_BUF_SIZE);
+  }
+  if (reader->codec == CODEC_UNKNOWN) {
+    /* The magic bytes are the first four of the input */
+    size_t len = 0;
+    ssize_t got = 1;
+    while (len < 4 && (got = read_fd(reader->fd, reader->buf + len,
+                                     READ_BUF_SIZE - len)) > 0) {
+      len += got;
+    }
+    if (got < 0) {
+      return -1;
+    }
+    const unsigned char *magic = (const unsigned char *)reader->buf;
+    if (len >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) {
+      reader->codec = CODEC_GZIP;
+    } else if (len >= 4 && memcmp(magic, "\x28\xb5\x2f\xfd", 4) == 0) {
+      reader->codec = CODEC_ZSTD;
+    } else {
+      reader->codec = CODEC_NONE;
+      return len;
+    }
+    if (!start_decoder(reader, len)) {
+      return -1;
+    }
+  }
+  for (;;) {
+    ssize_t got = decode(reader);
+    if (got != 0) {
+      return got;
+    }
+    if (reader->raw_pos < reader->raw_len) {
+      continue;
+    }
+    if (reader->raw_eof) {
+      if (reader->frame_done) {
+        return 0;
+      }
+      reader->decode_error = "truncated compressed input";
+      return -1;
+    }
+    got = read_fd(reader->fd, reader->raw, READ_BUF_SIZE);
+    if (got < 0) {
+      return -1;
+    }
+    reader->raw_pos = 0;
+    reader->raw_len = got;
+    reader->raw_eof = got == 0;
+  }
+}
+
+/* Frees the decompression state of a reader */
+static void free_reader(fd_reader *reader) {
+  free(reader->raw);
+#ifdef HAVE_ZLIB
+  if (reader->gzip) {
+    inflateEnd(reader->gzip);
+    free(reader->gzip);
+  }
+#endif
+#ifdef HAVE_ZSTD
+  ZSTD_freeDStream(reader->zstd);
+#endif
+}
+
+/* The message for a failed read */
+static const char *read_error(fd_reader *reader) {
+  return reader->decode_error ? reader->decode_error : strerror(reader->error);
+}
+
+/* Copies the next line, or as much of it as fits in `max` bytes, from the
+ * reader into `str`. Returns the number of bytes copied */
+static size_t read_chunk(fd_reader *reader, char *str, size_t max) {
+  size_t n = 0;
+  while (n < max) {
+    if (reader->pos == reader->len) {
+      if (reader->eof) {
+        break;
+      }
+      ssize_t got = read_input(reader);
+      if (got <= 0) {
+        reader->error = got < 0 ? (reader->decode_error ? EIO : errno) : 0;
+        reader->eof = true;
+        break;
+      }
+      reader->pos = 0;
+      reader->len = got;
+      if (reader->hash) {
+        xxh_update(reader->hash, reader->buf, got);
+      }
+    }
+    size_t avail = reader->len - reader->pos;
+    if (avail > max - n) {
+      avail = max - n;
+    }
+    char *start = reader->buf + reader->pos;
+    if (reader->line_start) {
+      reader->indented = *start == ' ' || *start == '\t';
+      reader->line_start = false;
+      reader->lineno++;
+    }
+    char *newline = memchr(start, '\n', avail);
+    size_t take = newline ? (size_t)(newline - start) + 1 : avail;
+    memcpy(str + n, start, take);
+    n += take;
+    reader->pos += take;
+    if (newline) {
+      reader->line_start = true;
+      break;
+    }
+  }
+  return n;
+}
+
+/* The inih reader for file descriptors. Like fgets it returns the next line,
+ * or as much of it as fits in `num - 1` bytes, inih then grows its line
+ * buffer and calls again for the rest, so lines have no length limit */
+static char *read_line(char *str, int num, void *stream) {
+  fd_reader *reader = (fd_reader *)stream;
+  bool line_start = reader->line_start;
+  size_t n = read_chunk(reader, str, num - 1);
+  if (n == 0) {
+    return NULL;
+  }
+  str[n] = '\0';
+  if (!line_start || *str != '!' || !reader->directive) {
+    return str;
+  }
+  /* Directives are read whole, whatever inih's buffer size. This runs on
+   * `ini -A` threads too, so it only uses malloc(3) */
+  char *line = strdup(str);
+  size_t len = n;
+  char chunk[256];
+  while (line && !reader->line_start &&
+         (n = read_chunk(reader, chunk, sizeof(chunk))) > 0) {
+    char *grown = realloc(line, len + n + 1);
+    if (!grown) {
+      free(line);
+      line = NULL;
+      break;
+    }
+    line = grown;
+    memcpy(line + len, chunk, n);
+    len += n;
+    line[len] = '\0';
+  }
+  if (!line) {
+    reader->error = ENOMEM;
+    reader->eof = true;
+    return NULL;
+  }
+  bool ok = reader->directive(reader->user, line);
+  free(line);
+  if (!ok) {
+    reader->failed = true;
+    return NULL;
+  }
+  /* Blank rather than skipped, so inih's line numbers stay right */
+  strcpy(str, "\n");
+  return str;
+}
+
+/* The progress of resolving `-R` references or `-i` inheritance */
+typedef enum { UNRESOLVED, RESOLVING, RESOLVED } resolve_state;
+
+/* A key kept by the store until every file is parsed */
+typedef struct store_entry {
+  struct store_entry *next; /* The next key of the section, in file order */
+  char *name;
+  char *value;
+  const char *layer; /* The file the value came from */
+  int lineno;
+  resolve_state state;
+} store_entry;
+
+/* A section kept by the store, its keys are found through `keys` */
+typedef struct {
+  char *name;
+  const char *layer;
+  int lineno;
+  store_entry *entries;
+  store_entry **tail;
+  HASH_TABLE *keys;
+  char **parents; /* `-i`, the sections this one inherits from */
+  size_t parents_len;
+  resolve_state state;
+} store_section;
+
+/* The entries of every file, merged so that each key is bound once */
+typedef struct {
+  HASH_TABLE *sections;
+  store_section **order; /* The sections in the order first parsed */
+  size_t len;
+  size_t size;
+} entry_store;
+
+/* User data for inih callback handler */
+typedef struct {
+  char *toc_var_name;
+  bool local_vars;
+  SHELL_VAR *toc_var;
+  SHELL_VAR *sec_var; /* Array of the section currently being parsed */
+  bool flat;          /* Store every key in the TOC as <SEC><SEP><KEY> */
+  char *flat_sep;
+  bool order;           /* Record file order in indexed arrays */
+  SHELL_VAR *order_var; /* <TOC>__order, the sections or flat keys */
+  SHELL_VAR *keys_var;  /* <TOC>_<INI_SECTION_NAME>__keys */
+  SHELL_VAR *callback;  /* Function passed triples instead of making arrays */
+  intmax_t quantum;     /* Number of triples passed per callback */
+  intmax_t batch_len;
+  WORD_LIST *batch; /* Pending triples, in reverse order */
+  int callback_status;
+  char **int_keys; /* `-T` keys, as <INI_SECTION_NAME>.<KEY> */
+  size_t int_keys_len;
+  bool int_auto;      /* `-I`, convert every value that is an integer */
+  SHELL_VAR *int_var; /* <TOC>_<INI_SECTION_NAME>__int, or <TOC>__int */
+  bool handler_failed;
+  ini_schema *schema;       /* `-S`, validate keys against a schema */
+  unsigned char *schema_seen; /* Which schema keys were parsed */
+  SHELL_VAR *errors_var;    /* Schema errors, <TOC>__errors by default */
+  intmax_t error_count;
+  char **paths; /* `-f` and `-D` files, read instead of the FD */
+  size_t paths_len;
+  const char *path; /* The file being parsed, if any */
+  bool check;       /* `-n`, only check the files for errors */
+  bool multiline;   /* `-m`, join continuation lines and decode values */
+  fd_reader *reader;
+  char *pending_section; /* The entry whose value is being decoded */
+  char *pending_name;
+  int pending_lineno;
+  char *value; /* The decoded value, reused for every entry */
+  size_t value_len;
+  size_t value_size;
+  char quote; /* The quote that opened the value, if any */
+  bool last_escaped;
+  entry_store *store; /* `-O`, entries are merged here and bound at the end */
+  bool resolve;       /* `-R`, replace references in the stored values */
+  bool inherit;       /* `-i`, sections inherit keys, `[CHILD : PARENT]` */
+  char **list_keys;   /* `-l` keys, as <INI_SECTION_NAME>.<KEY> */
+  size_t list_keys_len;
+  char *list_delims;  /* `-d`, the characters list values are split on */
+  bool collect;       /* `-r`, repeated `KEY[]` lines make a list */
+  HASH_TABLE *lists;  /* The list arrays made by this parse */
+  bool export;        /* `-x`, export every key as PREFIX_SECTION_KEY */
+  char *export_prefix; /* `-P` */
+  bool env_override;  /* `-E`, exported variables override the config */
+  HASH_TABLE *exported; /* The variables exported by this parse */
+  const char *layer;  /* The name of the file being parsed */
+  SHELL_VAR *prov_var; /* `-p`, the file each key came from */
+  HASH_TABLE *included; /* Real path to path of every file parsed */
+  char **include_stack; /* Real paths of the files being parsed */
+  size_t include_len;
+  char *real_toc_name; /* `-t`, the TOC named by `-a`, parsed into a shadow */
+  HASH_TABLE *shadows; /* `-t`, the names of the shadow arrays made */
+  struct ini_job *job; /* `ini_wait`, the job whose records are bound */
+  SHELL_VAR *hash_var; /* `-H`, the hashes of the input and the entries */
+  xxh_state input_hash;
+  uint64_t content_hash; /* The sum of the hashes of the entries bound */
+  bool lowercase;        /* `-L`, lowercase section and key names */
+  char *lower_section;   /* The lowercased names, reused for every entry */
+  size_t lower_section_size;
+  char *lower_name;
+  size_t lower_name_size;
+  char **keep_globs; /* `-k`, only keys matching one of these are kept */
+  size_t keep_globs_len;
+  char **drop_globs; /* `-K`, keys matching one of these are dropped */
+  size_t drop_globs_len;
+  bool mangle; /* `-M`, make section names legal, the TOC maps them back */
+} ini_conf;
+
+/* Parses a decimal, or 0x prefixed hexadecimal, integer with an optional
+ * sign. Unlike strtoimax(3) this does not depend on the locale, and unlike
+ * Bash arithmetic a leading zero does not make the value octal */
+static bool parse_int(const char *s, intmax_t *result) {
+  bool negative = false;
+  if (*s == '-' || *s == '+') {
+    negative = *s == '-';
+    s++;
+  }
+  unsigned int base = 10;
+  if (s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
+    base = 16;
+    s += 2;
+  }
+  if (!*s) {
+    return false;
+  }
+  uintmax_t limit = negative ? (uintmax_t)INTMAX_MAX + 1 : INTMAX_MAX;
+  uintmax_t n = 0;
+  for (; *s; s++) {
+    unsigned int digit;
+    if (*s >= '0' && *s <= '9') {
+      digit = *s - '0';
+    } else if (base == 16 && *s >= 'a' && *s <= 'f') {
+      digit = *s - 'a' + 10;
+    } else if (base == 16 && *s >= 'A' && *s <= 'F') {
+      digit = *s - 'A' + 10;
+    } else {
+      return false;
+    }
+    if (n > (limit - digit) / base) {
+      return false;
+    }
+    n = n * base + digit;
+  }
+  *result = negative && n ? -(intmax_t)(n - 1) - 1 : (intmax_t)n;
+  return true;
+}
+
+/* Hashes a section and key name, `seed` selects one of a family of hashes */
+static uint64_t schema_hash(uint64_t seed, const char *section,
+                            const char *name) {
+  uint64_t h = 14695981039346656037ULL ^ (seed * 0x9e3779b97f4a7c15ULL);
+  /* The section is prefixed with its length, so where it ends is never
+   * ambiguous */
+  h = (h ^ strlen(section)) * 1099511628211ULL;
+  for (const char *p = section; *p; p++) {
+    h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+  }
+  for (const char *p = name; *p; p++) {
+    h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+  }
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  return h;
+}
+
+/* Returns the schema declaration of `<section>.<name>`, or NULL */
+static schema_key *schema_lookup(ini_schema *schema, const char *section,
+                                 const char *name) {
+  if (!schema->len) {
+    return NULL;
+  }
+  uint64_t bucket = schema_hash(0, section, name) % schema->buckets;
+  uint64_t slot =
+      schema_hash(schema->disp[bucket], section, name) % schema->slots_len;
+  size_t i = schema->slots[slot];
+  if (i == SIZE_MAX) {
+    return NULL;
+  }
+  schema_key *key = &schema->keys[i];
+  if (strcmp(key->name, name) != 0 || strcmp(key->section, section) != 0) {
+    return NULL;
+  }
+  return key;
+}
+
+/* A key's place in the order buckets are filled in */
+typedef struct {
+  size_t bucket_size;
+  size_t bucket;
+  size_t key;
+} schema_order;
+
+/* Used with qsort to put the largest buckets first */
+static int compare_buckets(const void *a, const void *b) {
+  const schema_order *oa = a;
+  const schema_order *ob = b;
+  if (oa->bucket_size != ob->bucket_size) {
+    return oa->bucket_size < ob->bucket_size ? 1 : -1;
+  }
+  return oa->bucket < ob->bucket ? -1 : oa->bucket > ob->bucket;
+}
+
+/* Tries to find a displacement for every bucket that places all keys in
+ * distinct slots of the table. Buckets are placed largest first, as they are
+ * the hardest to fit */
+static bool schema_place(ini_schema *schema, schema_order *order) {
+  size_t *placed = xmalloc((schema->len + 1) * sizeof(size_t));
+  for (size_t i = 0; i < schema->slots_len; i++) {
+    schema->slots[i] = SIZE_MAX;
+  }
+  bool ok = true;
+  size_t i = 0;
+  while (ok && i < schema->len) {
+    size_t end = i;
+    while (end < schema->len && order[end].bucket == order[i].bucket) {
+      end++;
+    }
+    uint64_t d;
+    for (d = 1; d <= SCHEMA_MAX_DISP; d++) {
+      size_t j;
+      for (j = i; j < end; j++) {
+        schema_key *key = &schema->keys[order[j].key];
+        placed[j] = schema_hash(d, key->section, key->name) % schema->slots_len;
+        if (schema->slots[placed[j]] != SIZE_MAX) {
+          break;
+        }
+        schema->slots[placed[j]] = order[j].key;
+      }
+      if (j == end) {
+        break;
+      }
+      /* Undo the partial placement and try the next displacement */
+      while (j-- > i) {
+        schema->slots[placed[j]] = SIZE_MAX;
+      }
+    }
+    if (d > SCHEMA_MAX_DISP) {
+      ok = false;
+    }
+    schema->disp[order[i].bucket] = d;
+    i = end;
+  }
+  free(placed);
+  return ok;
+}
+
+/* Builds the perfect hash table over the schema's keys */
+static void schema_build(ini_schema *schema) {
+  size_t n = schema->len;
+  schema->buckets = n / 2 + 1;
+  schema->disp = xmalloc(schema->buckets * sizeof(uint64_t));
+  size_t *sizes = xmalloc(schema->buckets * sizeof(size_t));
+  schema_order *order = xmalloc((n + 1) * sizeof(schema_order));
+  /* Empty buckets are never placed, but unknown keys still hash to them */
+  memset(schema->disp, 0, schema->buckets * sizeof(uint64_t));
+  memset(sizes, 0, schema->buckets * sizeof(size_t));
+  for (size_t i = 0; i < n; i++) {
+    schema_key *key = &schema->keys[i];
+    order[i].bucket = schema_hash(0, key->section, key->name) % schema->buckets;
+    order[i].key = i;
+    sizes[order[i].bucket]++;
+  }
+  for (size_t i = 0; i < n; i++) {
+    order[i].bucket_size = sizes[order[i].bucket];
+  }
+  qsort(order, n, sizeof(schema_order), compare_buckets);
+  /* Start with a table a little larger than the key set and grow it on the
+   * rare occasion no displacement fits */
+  schema->slots_len = n + n / 8 + 1;
+  schema->slots = NULL;
+  for (;;) {
+    schema->slots =
+        xrealloc(schema->slots, schema->slots_len * sizeof(size_t));
+    if (schema_place(schema, order)) {
+      break;
+    }
+    schema->slots_len += schema->slots_len / 4 + 1;
+  }
+  free(sizes);
+  free(order);
+}
+
+/* Frees a schema and its keys */
+static void schema_free(ini_schema *schema) {
+  for (size_t i = 0; i < schema->len; i++) {
+    free(schema->keys[i].section);
+    free(schema->keys[i].name);
+  }
+  free(schema->keys);
+  free(schema->slots);
+  free(schema->disp);
+  free(schema);
+}
+
+/* Parses `MIN..MAX`, either bound may be left out */
+static bool parse_range(const char *range, schema_key *key) {
+  const char *dots = strstr(range, "..");
+  size_t min_len = dots - range;
+  char min[32];
+  if (min_len >= sizeof(min)) {
+    return false;
+  }
+  memcpy(min, range, min_len);
+  min[min_len] = '\0';
+  key->has_min = min_len > 0;
+  if (key->has_min && !parse_int(min, &key->min)) {
+    return false;
+  }
+  key->has_max = dots[2] != '\0';
+  if (key->has_max && !parse_int(dots + 2, &key->max)) {
+    return false;
+  }
+  return true;
+}
+
+/* The inih handler for schema files, every key declares a key of a config */
+static int schema_handler(void *user, const char *section, const char *name,
+                          const char *value, int lineno) {
+  ini_schema *schema = (ini_schema *)user;
+  if (!name) {
+    return 1;
+  }
+  schema_key key = {0};
+  char *spec = savestring(value);
+  char *save = NULL;
+  bool ok = true;
+  for (char *word = strtok_r(spec, " \t", &save); word && ok;
+       word = strtok_r(NULL, " \t", &save)) {
+    if (word == spec) {
+      if (strcmp(word, "string") == 0) {
+        key.type = SCHEMA_STRING;
+      } else if (strcmp(word, "int") == 0) {
+        key.type = SCHEMA_INT;
+      } else if (strcmp(word, "bool") == 0) {
+        key.type = SCHEMA_BOOL;
+      } else {
+        builtin_error("schema line %d: %s: unknown type `%s'", lineno, name,
+                      word);
+        ok = false;
+      }
+    } else if (strcmp(word, "required") == 0) {
+      key.required = true;
+    } else if (strstr(word, "..") && key.type != SCHEMA_BOOL) {
+      if (!parse_range(word, &key)) {
+        builtin_error("schema line %d: %s: invalid range `%s'", lineno, name,
+                      word);
+        ok = false;
+      }
+    } else {
+      builtin_error("schema line %d: %s: unexpected `%s'", lineno, name, word);
+      ok = false;
+    }
+  }
+  free(spec);
+  if (!ok) {
+    schema->failed = true;
+    return 0;
+  }
+  key.section = savestring(section);
+  key.name = savestring(name);
+  schema->keys = xrealloc(schema->keys, (schema->len + 1) * sizeof(key));
+  schema->keys[schema->len++] = key;
+  return 1;
+}
+
+/* Used with qsort to find repeated declarations */
+static int compare_schema_keys(const void *a, const void *b) {
+  const schema_key *ka = a;
+  const schema_key *kb = b;
+  int cmp = strcmp(ka->section, kb->section);
+  return cmp ? cmp : strcmp(ka->name, kb->name);
+}
+
+/* Returns the compiled schema at `path`. A schema is compiled once per shell
+ * and only compiled again when its file changes */
+static ini_schema *load_schema(const char *path) {
+  struct stat st;
+  if (stat(path, &st) < 0) {
+    builtin_error("%s: %s", path, strerror(errno));
+    return NULL;
+  }
+  ini_schema **prev = &schema_cache;
+  for (ini_schema *schema = schema_cache; schema; schema = schema->next) {
+    if (schema->dev == st.st_dev && schema->ino == st.st_ino) {
+      if (schema->size == st.st_size &&
+          schema->mtime.tv_sec == st.st_mtim.tv_sec &&
+          schema->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+        return schema;
+      }
+      *prev = schema->next;
+      schema_free(schema);
+      break;
+    }
+    prev = &schema->next;
+  }
+  ini_schema *schema = xmalloc(sizeof(ini_schema));
+  memset(schema, 0, sizeof(ini_schema));
+  int ret = ini_parse(path, schema_handler, schema);
+  if (ret != 0 || schema->failed) {
+    if (ret < 0) {
+      builtin_error("%s: unable to read schema", path);
+    } else if (!schema->failed) {
+      builtin_error("%s: malformed schema on line %d", path, ret);
+    }
+    schema_free(schema);
+    return NULL;
+  }
+  qsort(schema->keys, schema->len, sizeof(schema_key), compare_schema_keys);
+  for (size_t i = 1; i < schema->len; i++) {
+    if (compare_schema_keys(&schema->keys[i - 1], &schema->keys[i]) == 0) {
+      builtin_error("%s: %s.%s is declared twice", path,
+                    schema->keys[i].section, schema->keys[i].name);
+      schema_free(schema);
+      return NULL;
+    }
+  }
+  schema_build(schema);
+  schema->dev = st.st_dev;
+  schema->ino = st.st_ino;
+  schema->mtime = st.st_mtim;
+  schema->size = st.st_size;
+  schema->next = schema_cache;
+  schema_cache = schema;
+  return schema;
+}
+
+/* Returns an empty associative array named `name`, local to the current
+ * function or global. An associative array that already exists in that scope
+ * is reused and, if `flush` is set, emptied in place, any other variable of
+ * that name is converted in place, as make_local_assoc_variable does.
+ * Flushing keeps the array's bucket allocation, so re-parsing a config of the
+ * same shape into the same TOC allocates little more than the keys and values
+ * themselves */
+SHELL_VAR *ini_make_assoc(char *name, bool local_vars, bool flush) {
+  SHELL_VAR *var = NULL;
+  if (local_vars) {
+    int vflags = 0;
+    var = make_local_assoc_variable(name, vflags);
+  } else {
+    var = find_global_variable(name);
+    if (!var) {
+      var = make_new_assoc_variable(name);
+    }
+  }
+  if (!var) {
+    return NULL;
+  }
+  if (readonly_p(var) || noassign_p(var)) {
+    sh_readonly(name);
+    return NULL;
+  }
+  /* A second variable of the same name would hide this one */
+  if (!assoc_p(var)) {
+    if (array_p(var)) {
+      array_dispose(array_cell(var));
+      var_setvalue(var, NULL);
+    }
+    var = convert_var_to_assoc(var);
+  }
+  if (flush) {
+    assoc_flush(assoc_cell(var));
+  }
+  return var;
+}
+
+/* Returns an empty indexed array named `name`, reusing or converting an
+ * existing variable in the requested scope in the same way as
+ * ini_make_assoc */
+static SHELL_VAR *ini_make_array(char *name, bool local_vars) {
+  SHELL_VAR *var = NULL;
+  if (local_vars) {
+    int vflags = 0;
+    var = make_local_array_variable(name, vflags);
+  } else {
+    var = find_global_variable(name);
+    if (!var) {
+      var = make_new_array_variable(name);
+    }
+  }
+  if (!var) {
+    return NULL;
+  }
+  if (readonly_p(var) || noassign_p(var)) {
+    sh_readonly(name);
+    return NULL;
+  }
+  if (!array_p(var)) {
+    if (assoc_p(var)) {
+      assoc_dispose(assoc_cell(var));
+      var_setvalue(var, NULL);
+      VUNSETATTR(var, att_assoc);
+    }
+    var = convert_var_to_array(var);
+  }
+  array_flush(array_cell(var));
+  return var;
+}
+
+/* Returns a newly allocated `<prefix><sep><suffix>` string */
+static char *join_name(const char *prefix, const char *sep,
+                       const char *suffix) {
+  size_t prefix_len = strlen(prefix);
+  size_t sep_len = strlen(sep);
+  size_t suffix_len = strlen(suffix);
+  char *name = xmalloc(prefix_len + sep_len + suffix_len + 1);
+  memcpy(name, prefix, prefix_len);
+  memcpy(name + prefix_len, sep, sep_len);
+  memcpy(name + prefix_len + sep_len, suffix, suffix_len + 1);
+  return name;
+}
+
+/* The arrays made by the parses of each TOC, by TOC name, so that
+ * `ini_unset` removes what was made rather than what the TOC lists now.
+ * Each name maps to the variable context of the array, a local array goes
+ * with its function and the name may then be another variable's */
+static HASH_TABLE *registry;
+
+static void register_var(const char *toc_var_name, SHELL_VAR *var) {
+  if (!registry) {
+    registry = hash_create(16);
+  }
+  BUCKET_CONTENTS *item = hash_search(toc_var_name, registry, 0);
+  if (!item) {
+    item = hash_insert(savestring(toc_var_name), registry, HASH_NOSRCH);
+    item->data = hash_create(64);
+  }
+  BUCKET_CONTENTS *entry = hash_search(var->name, item->data, 0);
+  if (!entry) {
+    entry = hash_insert(savestring(var->name), item->data, HASH_NOSRCH);
+    entry->data = xmalloc(sizeof(int));
+  }
+  *(int *)entry->data = var->context;
+}
+
+HASH_TABLE *ini_registry_take(const char *toc_var_name) {
+  BUCKET_CONTENTS *item =
+      registry ? hash_remove(toc_var_name, registry, 0) : NULL;
+  if (!item) {
+    return NULL;
+  }
+  HASH_TABLE *names = item->data;
+  free(item->key);
+  free(item);
+  return names;
+}
+
+/* Records an array made from the TOC name in the registry. With `-t` it is
+ * a shadow array, only registered by finish_shadows, under the name it is
+ * moved to, once the parse succeeds */
+static SHELL_VAR *track_var(ini_conf *conf, char *name, SHELL_VAR *var) {
+  if (!var) {
+    return NULL;
+  }
+  if (!conf->shadows) {
+    register_var(conf->toc_var_name, var);
+    return var;
+  }
+  if (!hash_search(name, conf->shadows, 0)) {
+    hash_insert(savestring(name), conf->shadows, HASH_NOSRCH);
+  }
+  return var;
+}
+
+/* ini_make_assoc and ini_make_array for the arrays named after the TOC */
+static SHELL_VAR *make_assoc(ini_conf *conf, char *name, bool flush) {
+  return track_var(conf, name, ini_make_assoc(name, conf->local_vars, flush));
+}
+
+static SHELL_VAR *make_array(ini_conf *conf, char *name) {
+  return track_var(conf, name, ini_make_array(name, conf->local_vars));
+}
+
+/* Makes the `-p` or `-H` array. With `-t` it is a shadow array too, the
+ * shadows table then holds the name it is moved to */
+static SHELL_VAR *make_report(ini_conf *conf, char *name) {
+  if (!conf->shadows) {
+    return ini_make_assoc(name, conf->local_vars, true);
+  }
+  char *shadow = join_name("__ini_shadow", "__", name);
+  SHELL_VAR *var = ini_make_assoc(shadow, conf->local_vars, true);
+  if (var && !hash_search(shadow, conf->shadows, 0)) {
+    hash_insert(savestring(shadow), conf->shadows, HASH_NOSRCH)->data =
+        savestring(name);
+  }
+  free(shadow);
+  return var;
+}
+
+/* Appends `value` to the indexed array `var` */
+static void append_array(SHELL_VAR *var, char *value) {
+  ARRAY *array = array_cell(var);
+  array_insert(array, array_max_index(array) + 1, value);
+  VUNSETATTR(var, att_invisible); /* no longer invisible */
+}
+
+/* Calls the `-C` callback with the pending batch of section, key and value
+ * triples, returns false if the callback failed */
+static bool run_callback(ini_conf *conf) {
+  if (!conf->batch) {
+    return true;
+  }
+  WORD_LIST *words = make_word_list(make_word(conf->callback->name),
+                                    REVERSE_LIST(conf->batch, WORD_LIST *));
+  conf->batch = NULL;
+  conf->batch_len = 0;
+  conf->callback_status = execute_shell_function(conf->callback, words);
+  dispose_words(words);
+  return conf->callback_status == EXECUTION_SUCCESS;
+}
+
+/* Returns the `<sec_var_name>__<suffix>` array kept alongside a section array.
+ * It is emptied when the section is first seen and reused when the section's
+ * header is repeated */
+static SHELL_VAR *companion_array(ini_conf *conf, const char *sec_var_name,
+                                  const char *suffix, bool assoc, bool seen) {
+  char *var_name = join_name(sec_var_name, "__", suffix);
+  SHELL_VAR *var = NULL;
+  if (seen) {
+    var = conf->local_vars ? find_variable(var_name)
+                           : find_global_variable(var_name);
+  } else if (assoc) {
+    var = make_assoc(conf, var_name, true);
+  } else {
+    var = make_array(conf, var_name);
+  }
+  if (!var) {
+    builtin_error("Could not make %s", var_name);
+  }
+  free(var_name);
+  return var;
+}
+
+/* Returns true if `<section>.<name>` is one of `keys` */
+static bool key_listed(char **keys, size_t keys_len, const char *section,
+                       const char *name) {
+  size_t sec_len = strlen(section);
+  for (size_t i = 0; i < keys_len; i++) {
+    const char *key = keys[i];
+    if (sec_len == 0) {
+      if (strcmp(key, name) == 0) {
+        return true;
+      }
+    } else if (strncmp(key, section, sec_len) == 0 && key[sec_len] == '.' &&
+               strcmp(key + sec_len + 1, name) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Returns true if `-T` typed `<section>.<name>` as an integer */
+static bool is_int_key(ini_conf *conf, const char *section, const char *name) {
+  return key_listed(conf->int_keys, conf->int_keys_len, section, name);
+}
+
+/* Returns true if any key of `section` may be converted to an integer */
+static bool has_int_keys(ini_conf *conf, const char *section) {
+  if (conf->int_auto) {
+    return true;
+  }
+  size_t sec_len = strlen(section);
+  for (size_t i = 0; i < conf->int_keys_len; i++) {
+    const char *key = conf->int_keys[i];
+    if (strncmp(key, section, sec_len) == 0 && key[sec_len] == '.') {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Adds `value` to the integer array under `key` if `-I` or `-T` ask for it.
+ * Values that are not integers are skipped with `-I`, but are an error for a
+ * key typed with `-T` */
+static bool bind_int(ini_conf *conf, const char *section, const char *name,
+                     char *key, const char *value) {
+  bool typed = is_int_key(conf, section, name);
+  if (!typed && !conf->int_auto) {
+    return true;
+  }
+  intmax_t n;
+  if (!parse_int(value, &n)) {
+    if (typed) {
+      builtin_error("%s%s%s: `%s': invalid integer", section,
+                    *section ? "." : "", name, value);
+      return false;
+    }
+    return true;
+  }
+  if (!conf->int_var) {
+    return true;
+  }
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%jd", n);
+  bind_assoc_variable(conf->int_var, conf->int_var->name, savestring(key), buf,
+                      0);
+  return true;
+}
+
+/* Copies the text from `start` to `end` without surrounding whitespace */
+static char *trim_copy(const char *start, const char *end) {
+  while (start < end && isspace((unsigned char)*start)) {
+    start++;
+  }
+  while (end > start && isspace((unsigned char)end[-1])) {
+    end--;
+  }
+  return substring(start, 0, end - start);
+}
+
+/* Returns a copy of a section name with every character that cannot be in a
+ * variable name made `_`, for `-M` */
+static char *mangle_name(const char *section) {
+  char *name = savestring(section);
+  for (char *c = name; *c; c++) {
+    if (!isalnum((unsigned char)*c) && *c != '_') {
+      *c = '_';
+    }
+  }
+  return name;
+}
+
+/* Adds the items of a list key to the indexed array <TOC>_<SEC>_<KEY>. A
+ * `KEY = value` line replaces the array like it replaces the value, the
+ * lines of a repeated `KEY[]` are appended. With `-d` the value is split on
+ * any of the delimiters, items are trimmed and empty ones dropped */
+static bool bind_list(ini_conf *conf, const char *section, const char *name,
+                      const char *value, bool append) {
+  char *mangled = conf->mangle ? mangle_name(section) : NULL;
+  char *sec_var_name =
+      *section ? join_name(conf->toc_var_name, "_", mangled ? mangled : section)
+               : savestring(conf->toc_var_name);
+  char *list_var_name = join_name(sec_var_name, "_", name);
+  free(sec_var_name);
+  free(mangled);
+  if (!legal_identifier(list_var_name)) {
+    sh_invalidid(list_var_name);
+    free(list_var_name);
+    return false;
+  }
+  /* <TOC>_<SEC>_<KEY> is also the array of a section named <SEC>_<KEY> */
+  const char *sec_name = list_var_name + strlen(conf->toc_var_name) + 1;
+  if (!conf->flat && assoc_reference(assoc_cell(conf->toc_var), sec_name)) {
+    builtin_error("%s: both a list and the array of a section", list_var_name);
+    free(list_var_name);
+    return false;
+  }
+  if (!conf->lists) {
+    conf->lists = hash_create(16);
+  }
+  SHELL_VAR *list_var;
+  if (hash_search(list_var_name, conf->lists, 0)) {
+    list_var = conf->local_vars ? find_variable(list_var_name)
+                                : find_global_variable(list_var_name);
+    /* A key set again replaces its list, as it does its value */
+    if (list_var && array_p(list_var) && !append) {
+      array_flush(array_cell(list_var));
+    }
+  } else {
+    list_var = make_array(conf, list_var_name);
+    hash_insert(savestring(list_var_name), conf->lists, HASH_NOSRCH);
+  }
+  if (!list_var || !array_p(list_var)) {
+    builtin_error("Could not make %s", list_var_name);
+    free(list_var_name);
+    return false;
+  }
+  free(list_var_name);
+  if (!conf->list_delims) {
+    append_array(list_var, (char *)value);
+    return true;
+  }
+  for (const char *item = value;;) {
+    const char *end = item + strcspn(item, conf->list_delims);
+    char *copy = trim_copy(item, end);
+    if (*copy) {
+      append_array(list_var, copy);
+    }
+    free(copy);
+    if (!*end) {
+      break;
+    }
+    item = end + 1;
+  }
+  return true;
+}
+
+/* Hashes an entry for `-H`. The content hash is the sum of the hashes of
+ * the entries bound, so it does not depend on their order, and a value that
+ * is replaced is taken out of it again */
+static uint64_t entry_hash(const char *section, const char *name,
+                           const char *value) {
+  xxh_state state;
+  xxh_init(&state);
+  /* The parts are prefixed with their lengths, so no two entries hash the
+   * same bytes */
+  size_t section_len = strlen(section);
+  size_t name_len = strlen(name);
+  xxh_update_u64(&state, section_len);
+  xxh_update(&state, section, section_len);
+  xxh_update_u64(&state, name_len);
+  xxh_update(&state, name, name_len);
+  xxh_update(&state, value, strlen(value));
+  return xxh_digest(&state);
+}
+
+static void hash_entry(ini_conf *conf, const char *section, const char *name,
+                       const char *old, const char *value) {
+  if (!conf->hash_var) {
+    return;
+  }
+  if (old) {
+    conf->content_hash -= entry_hash(section, name, old);
+  }
+  conf->content_hash += entry_hash(section, name, value);
+}
+
+/* Binds a key into the section array, or the TOC in flat mode */
+static bool bind_key(ini_conf *conf, const char *section, const char *name,
+                     const char *value) {
+  char *toc_var_name = conf->toc_var_name;
+  if (conf->flat) {
+    char *key = *section ? join_name(section, conf->flat_sep, name)
+                         : savestring(name);
+    char *old = assoc_reference(assoc_cell(conf->toc_var), key);
+    if (conf->order && !old) {
+      append_array(conf->order_var, key);
+    }
+    if (!bind_int(conf, section, name, key, value)) {
+      free(key);
+      return false;
+    }
+    hash_entry(conf, section, name, old, value);
+    bind_assoc_variable(conf->toc_var, toc_var_name, key, (char *)value, 0);
+    return true;
+  }
+  if (!conf->sec_var) {
+    builtin_error("Malformed ini, %s is outside of a section", name);
+    return false;
+  }
+  char *old = assoc_reference(assoc_cell(conf->sec_var), name);
+  if (conf->order && !old) {
+    append_array(conf->keys_var, (char *)name);
+  }
+  if (!bind_int(conf, section, name, (char *)name, value)) {
+    return false;
+  }
+  hash_entry(conf, section, name, old, value);
+  bind_assoc_variable(conf->sec_var, conf->sec_var->name, strdup(name),
+                      (char *)value, 0);
+  return true;
+}
+
+/* Makes the name `-x` exports a key as, PREFIX_SECTION_KEY in upper case
+ * with every character that is not a letter or digit made `_` */
+static char *export_name(const char *prefix, const char *section,
+                         const char *name) {
+  const char *parts[] = {prefix, section, name};
+  size_t len = 0;
+  for (size_t i = 0; i < 3; i++) {
+    len += parts[i] ? strlen(parts[i]) + 1 : 0;
+  }
+  char *var_name = xmalloc(len + 1);
+  char *p = var_name;
+  for (size_t i = 0; i < 3; i++) {
+    if (!parts[i] || !*parts[i]) {
+      continue;
+    }
+    if (p > var_name) {
+      *p++ = '_';
+    }
+    for (const char *c = parts[i]; *c; c++) {
+      *p++ = isalnum((unsigned char)*c) ? toupper((unsigned char)*c) : '_';
+    }
+  }
+  *p = '\0';
+  return var_name;
+}
+
+/* Exports a key with `-x`. With `-E` a variable of that name exported
+ * before the parse overrides the value, which is then also what the arrays
+ * get */
+static bool export_entry(ini_conf *conf, const char *section,
+                         const char *name, const char **value) {
+  char *var_name = export_name(conf->export_prefix, section, name);
+  if (!legal_identifier(var_name)) {
+    sh_invalidid(var_name);
+    free(var_name);
+    return false;
+  }
+  if (!conf->exported) {
+    conf->exported = hash_create(64);
+  }
+  SHELL_VAR *var = find_variable(var_name);
+  bool ours = hash_search(var_name, conf->exported, 0) != NULL;
+  if (conf->env_override && !ours && var && exported_p(var) &&
+      !array_p(var) && !assoc_p(var)) {
+    *value = value_cell(var);
+  } else if (conf->export) {
+    var = bind_variable(var_name, (char *)*value, 0);
+    if (!var) {
+      free(var_name);
+      return false;
+    }
+    VSETATTR(var, att_exported);
+    array_needs_making = 1;
+    if (!ours) {
+      hash_insert(savestring(var_name), conf->exported, HASH_NOSRCH);
+    }
+  }
+  free(var_name);
+  return true;
+}
+
+/* Binds a key to the section array, and with the options for them exports
+ * it and adds it to its list array */
+static bool bind_value(ini_conf *conf, const char *section, const char *name,
+                       const char *value, bool list) {
+  if ((conf->export || conf->env_override) &&
+      !export_entry(conf, section, name, &value)) {
+    return false;
+  }
+  /* `-x` without a TOC only exports */
+  if (!conf->toc_var) {
+    hash_entry(conf, section, name, NULL, value);
+    return true;
+  }
+  if (!bind_key(conf, section, name, value)) {
+    return false;
+  }
+  if (list || key_listed(conf->list_keys, conf->list_keys_len, section, name)) {
+    return bind_list(conf, section, name, value, list);
+  }
+  return true;
+}
+
+/* Creates <TOC>_<KEY> for a new section and adds it to the TOC under `key`,
+ * which is the section name unless `-M` mangled it */
+static bool bind_section(ini_conf *conf, const char *key,
+                         const char *section) {
+  /* Create <TOC>_<INI_SECTION_NAME> */
+  char *toc_var_name = conf->toc_var_name;
+  char *sep = "_";
+  size_t sec_size = strlen(toc_var_name) + strlen(key) + strlen(sep) +
+                    1; // +1 for the NUL character
+  char *sec_var_name = xmalloc(sec_size);
+  char *sec_end = sec_var_name + sec_size - 1;
+  char *p = memccpy(sec_var_name, toc_var_name, '\0', sec_size);
+  if (!p) {
+    builtin_error("Unable to create section name");
+    return false;
+  }
+  p = memccpy(p - 1, sep, '\0', sec_end - p + 2);
+  if (!p) {
+    builtin_error("Unable to create section name");
+    return false;
+  }
+  p = memccpy(p - 1, key, '\0', sec_end - p + 2);
+  if (!p) {
+    builtin_error("Unable to create section name");
+    return false;
+  }
+  if (conf->lists && hash_search(sec_var_name, conf->lists, 0)) {
+    builtin_error("%s: both a list and the array of a section", sec_var_name);
+    free(sec_var_name);
+    return false;
+  }
+  if (!legal_identifier(sec_var_name)) {
+    /* Report the name the section would have had, not the shadow one */
+    char *real_name = conf->shadows
+                          ? join_name(conf->real_toc_name, sep, section)
+                          : savestring(sec_var_name);
+    sh_invalidid(real_name);
+    free(real_name);
+    free(sec_var_name);
+    return false;
+  }
+  /* The TOC was emptied before parsing, so a section already in it was seen
+   * earlier in this file. Its keys are added to the existing array rather
+   * than flushing the ones parsed so far */
+  char *seen_as = assoc_reference(assoc_cell(conf->toc_var), key);
+  bool seen = seen_as != NULL;
+  if (seen && conf->mangle && strcmp(seen_as, section) != 0) {
+    builtin_error("%s: [%s] and [%s] would share it", sec_var_name, seen_as,
+                  section);
+    free(sec_var_name);
+    return false;
+  }
+  if (!seen) {
+    bind_assoc_variable(conf->toc_var, toc_var_name, strdup(key),
+                        conf->mangle ? (char *)section : "true", 0);
+  }
+  conf->sec_var = make_assoc(conf, sec_var_name, !seen);
+  if (!conf->sec_var) {
+    builtin_error("Could not make %s", sec_var_name);
+    free(sec_var_name);
+    return false;
+  }
+  if (conf->order) {
+    if (!seen) {
+      append_array(conf->order_var, (char *)key);
+    }
+    conf->keys_var = companion_array(conf, sec_var_name, "keys", false, seen);
+    if (!conf->keys_var) {
+      free(sec_var_name);
+      return false;
+    }
+  }
+  conf->int_var = NULL;
+  if (has_int_keys(conf, section)) {
+    conf->int_var = companion_array(conf, sec_var_name, "int", true, seen);
+    if (!conf->int_var) {
+      free(sec_var_name);
+      return false;
+    }
+    VSETATTR(conf->int_var, att_integer);
+  }
+  free(sec_var_name);
+  return true;
+}
+
+/* This function creates and populates our associative arrays in Bash. Both for
+ * the TOC array as well as for the individual section arrays,
+ * <TOC>_<INI_SECTION_NAME> */
+static bool bind_entry(ini_conf *conf, const char *section, const char *name,
+                       const char *value) {
+  /* In callback mode triples are batched up rather than bound, so that only
+   * `quantum` of them are ever held in memory */
+  if (conf->callback) {
+    if (!name || !value) {
+      return true;
+    }
+    hash_entry(conf, section, name, NULL, value);
+    conf->batch = make_word_list(make_word(section), conf->batch);
+    conf->batch = make_word_list(make_word(name), conf->batch);
+    conf->batch = make_word_list(make_word(value), conf->batch);
+    if (++conf->batch_len < conf->quantum) {
+      return true;
+    }
+    return run_callback(conf);
+  }
+  /* New section parsed */
+  if (!name && !value) {
+    /* Flat mode has no per section state, nor does `-x` without a TOC */
+    if (conf->flat || !conf->toc_var) {
+      return true;
+    }
+    char *mangled = conf->mangle ? mangle_name(section) : NULL;
+    bool ok = bind_section(conf, mangled ? mangled : section, section);
+    free(mangled);
+    return ok;
+  }
+  if (!name) {
+    builtin_error("Malformed ini, name is NULL!");
+    return false;
+  }
+  if (!value) {
+    builtin_error("Malformed ini, value is NULL!");
+    return false;
+  }
+  /* With `-r` a key written `KEY[]` is a list, its lines all go to `KEY` */
+  char *base = NULL;
+  size_t name_len = strlen(name);
+  if (conf->collect && name_len > 2 && strcmp(name + name_len - 2, "[]") == 0) {
+    name = base = substring(name, 0, name_len - 2);
+  }
+  bool ok = bind_value(conf, section, name, value, base != NULL);
+  free(base);
+  return ok;
+}
+
+/* Appends a formatted message to the errors array */
+static void add_error(ini_conf *conf, const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  int len = vsnprintf(NULL, 0, fmt, args);
+  va_end(args);
+  char *msg = xmalloc(len + 1);
+  va_start(args, fmt);
+  vsnprintf(msg, len + 1, fmt, args);
+  va_end(args);
+  append_array(conf->errors_var, msg);
+  free(msg);
+  conf->error_count++;
+}
+
+/* Returns true for the spellings of a boolean Bash scripts commonly test */
+static bool is_bool(const char *value) {
+  static const char *bools[] = {"true", "false", "yes", "no", "on",
+                                "off",  "1",     "0",   NULL};
+  for (const char **b = bools; *b; b++) {
+    if (strcasecmp(value, *b) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Checks a key and its value against the schema, recording any violation
+ * rather than stopping the parse */
+static void validate_entry(ini_conf *conf, const char *section,
+                           const char *name, const char *value, int lineno) {
+  schema_key *key = schema_lookup(conf->schema, section, name);
+  if (!key) {
+    add_error(conf, "%d: %s.%s: unknown key", lineno, section, name);
+    return;
+  }
+  conf->schema_seen[key - conf->schema->keys] = 1;
+  intmax_t n;
+  switch (key->type) {
+  case SCHEMA_INT:
+    if (!parse_int(value, &n)) {
+      add_error(conf, "%d: %s.%s: `%s' is not an integer", lineno, section,
+                name, value);
+      return;
+    }
+    break;
+  case SCHEMA_BOOL:
+    if (!is_bool(value)) {
+      add_error(conf, "%d: %s.%s: `%s' is not a boolean", lineno, section,
+                name, value);
+    }
+    return;
+  case SCHEMA_STRING:
+    n = (intmax_t)strlen(value);
+    break;
+  }
+  if ((key->has_min && n < key->min) || (key->has_max && n > key->max)) {
+    add_error(conf, "%d: %s.%s: `%s' is out of range", lineno, section, name,
+              value);
+  }
+}
+
+/* Records every required schema key missing from the parsed config */
+static void check_required(ini_conf *conf) {
+  for (size_t i = 0; i < conf->schema->len; i++) {
+    schema_key *key = &conf->schema->keys[i];
+    if (key->required && !conf->schema_seen[i]) {
+      add_error(conf, "%s.%s: required key is missing", key->section,
+                key->name);
+    }
+  }
+}
+
+/* This is the inih handler called for every new section and for every name and
+ * value in a section. inih stops at the first handler error, so record that
+ * the error has already been reported */
+static bool add_entry(ini_conf *conf, const char *section, const char *name,
+                      const char *value, int lineno) {
+  if (conf->schema && name && value) {
+    validate_entry(conf, section, name, value, lineno);
+  }
+  if (!bind_entry(conf, section, name, value)) {
+    conf->handler_failed = true;
+    return false;
+  }
+  return true;
+}
+
+static void section_add(store_section *sec, const char *name,
+                        const char *value, const char *layer, int lineno);
+
+/* Adds an entry to the store. A key parsed again replaces the value it had,
+ * but keeps its place */
+static store_section *store_add(entry_store *store, const char *section,
+                                const char *name, const char *value,
+                                const char *layer, int lineno) {
+  if (!store->sections) {
+    store->sections = hash_create(64);
+  }
+  BUCKET_CONTENTS *bucket = hash_search(section, store->sections, 0);
+  store_section *sec;
+  if (bucket) {
+    sec = (store_section *)bucket->data;
+  } else {
+    sec = xmalloc(sizeof(store_section));
+    memset(sec, 0, sizeof(store_section));
+    sec->name = savestring(section);
+    sec->layer = layer;
+    sec->lineno = lineno;
+    sec->tail = &sec->entries;
+    sec->keys = hash_create(64);
+    hash_insert(savestring(section), store->sections, HASH_NOSRCH)->data = sec;
+    if (store->len == store->size) {
+      store->size = store->size ? store->size * 2 : 16;
+      store->order =
+          xrealloc(store->order, store->size * sizeof(*store->order));
+    }
+    store->order[store->len++] = sec;
+  }
+  if (name) {
+    section_add(sec, name, value, layer, lineno);
+  }
+  return sec;
+}
+
+/* Adds a key to a section of the store */
+static void section_add(store_section *sec, const char *name,
+                        const char *value, const char *layer, int lineno) {
+  BUCKET_CONTENTS *bucket = hash_search(name, sec->keys, 0);
+  store_entry *entry;
+  if (bucket) {
+    entry = (store_entry *)bucket->data;
+    free(entry->value);
+  } else {
+    entry = xmalloc(sizeof(store_entry));
+    entry->next = NULL;
+    entry->name = savestring(name);
+    *sec->tail = entry;
+    sec->tail = &entry->next;
+    hash_insert(savestring(name), sec->keys, HASH_NOSRCH)->data = entry;
+  }
+  entry->value = savestring(value);
+  entry->layer = layer;
+  entry->lineno = lineno;
+  entry->state = UNRESOLVED;
+}
+
+/* Finds a key of the store, NULL if it was not parsed */
+static store_entry *store_find(entry_store *store, const char *section,
+                               const char *name) {
+  BUCKET_CONTENTS *bucket = hash_search(section, store->sections, 0);
+  if (!bucket) {
+    return NULL;
+  }
+  bucket = hash_search(name, ((store_section *)bucket->data)->keys, 0);
+  return bucket ? (store_entry *)bucket->data : NULL;
+}
+
+/* Appends `len` bytes to a growing buffer */
+static void append_bytes(char **buf, size_t *len, size_t *size,
+                         const char *bytes, size_t n) {
+  if (*len + n + 1 > *size) {
+    while (*len + n + 1 > *size) {
+      *size = *size ? *size * 2 : 64;
+    }
+    *buf = xrealloc(*buf, *size);
+  }
+  memcpy(*buf + *len, bytes, n);
+  *len += n;
+  (*buf)[*len] = '\0';
+}
+
+/* Replaces the `${SECTION:KEY}` and `${VAR}` references in a value of the
+ * store, `$$` being a literal `$`. A key is resolved before any value that
+ * refers to it and only once, meeting a key that is still being resolved
+ * means the references form a cycle */
+static bool resolve_entry(ini_conf *conf, const char *section,
+                          store_entry *entry) {
+  if (entry->state == RESOLVED) {
+    return true;
+  }
+  if (entry->state == RESOLVING) {
+    builtin_error("%s:%d: %s.%s: interpolation cycle", entry->layer,
+                  entry->lineno, section, entry->name);
+    return false;
+  }
+  if (!strchr(entry->value, '$')) {
+    entry->state = RESOLVED;
+    return true;
+  }
+  entry->state = RESOLVING;
+  char *out = NULL;
+  size_t len = 0, size = 0;
+  append_bytes(&out, &len, &size, "", 0);
+  const char *p = entry->value;
+  while (*p) {
+    const char *dollar = strchr(p, '$');
+    if (!dollar) {
+      append_bytes(&out, &len, &size, p, strlen(p));
+      break;
+    }
+    append_bytes(&out, &len, &size, p, dollar - p);
+    p = dollar + 1;
+    if (*p != '{') {
+      p += *p == '$';
+      append_bytes(&out, &len, &size, "$", 1);
+      continue;
+    }
+    const char *ref = p + 1;
+    const char *close = strchr(ref, '}');
+    if (!close) {
+      builtin_error("%s:%d: %s.%s: unterminated reference", entry->layer,
+                    entry->lineno, section, entry->name);
+      goto fail;
+    }
+    p = close + 1;
+    char *name = substring(ref, 0, close - ref);
+    char *colon = strchr(name, ':');
+    const char *value;
+    if (colon) {
+      *colon = '\0';
+      store_entry *target = store_find(conf->store, name, colon + 1);
+      if (!target) {
+        builtin_error("%s:%d: %s.%s: ${%s:%s}: no such key", entry->layer,
+                      entry->lineno, section, entry->name, name, colon + 1);
+        free(name);
+        goto fail;
+      }
+      if (!resolve_entry(conf, name, target)) {
+        free(name);
+        goto fail;
+      }
+      value = target->value;
+    } else {
+      /* Looked up in the shell, so unexported variables work too */
+      value = get_string_value(name);
+      if (!value) {
+        builtin_error("%s:%d: %s.%s: ${%s}: unset variable", entry->layer,
+                      entry->lineno, section, entry->name, name);
+        free(name);
+        goto fail;
+      }
+    }
+    append_bytes(&out, &len, &size, value, strlen(value));
+    free(name);
+  }
+  free(entry->value);
+  entry->value = out;
+  entry->state = RESOLVED;
+  return true;
+fail:
+  free(out);
+  return false;
+}
+
+/* Passed to hash_flush for tables that do not own their data */
+static void keep_data(void *data) { (void)data; }
+
+/* Frees the store. The hash tables only point at the sections and entries,
+ * which are freed through the section order */
+static void store_free(entry_store *store) {
+  for (size_t i = 0; i < store->len; i++) {
+    store_section *sec = store->order[i];
+    store_entry *entry = sec->entries;
+    while (entry) {
+      store_entry *next = entry->next;
+      free(entry->name);
+      free(entry->value);
+      free(entry);
+      entry = next;
+    }
+    hash_flush(sec->keys, keep_data);
+    hash_dispose(sec->keys);
+    for (size_t j = 0; j < sec->parents_len; j++) {
+      free(sec->parents[j]);
+    }
+    free(sec->parents);
+    free(sec->name);
+    free(sec);
+  }
+  if (store->sections) {
+    hash_flush(store->sections, keep_data);
+    hash_dispose(store->sections);
+  }
+  free(store->order);
+  free(store);
+}
+
+/* Copies the keys a section inherits into it, after those of its parents.
+ * The first parent listed wins when several have a key */
+static bool inherit_section(ini_conf *conf, store_section *sec) {
+  if (sec->state == RESOLVED) {
+    return true;
+  }
+  if (sec->state == RESOLVING) {
+    builtin_error("%s:%d: [%s]: inheritance cycle", sec->layer, sec->lineno,
+                  sec->name);
+    return false;
+  }
+  sec->state = RESOLVING;
+  for (size_t i = 0; i < sec->parents_len; i++) {
+    BUCKET_CONTENTS *bucket =
+        hash_search(sec->parents[i], conf->store->sections, 0);
+    if (!bucket) {
+      builtin_error("%s:%d: [%s]: %s: no such section", sec->layer,
+                    sec->lineno, sec->name, sec->parents[i]);
+      return false;
+    }
+    store_section *parent = (store_section *)bucket->data;
+    if (!inherit_section(conf, parent)) {
+      return false;
+    }
+    for (store_entry *entry = parent->entries; entry; entry = entry->next) {
+      if (!hash_search(entry->name, sec->keys, 0)) {
+        section_add(sec, entry->name, entry->value, entry->layer,
+                    entry->lineno);
+      }
+    }
+  }
+  sec->state = RESOLVED;
+  return true;
+}
+
+/* Binds the merged entries of the store, each section and key exactly once */
+static bool replay_store(ini_conf *conf) {
+  entry_store *store = conf->store;
+  for (size_t i = 0; conf->inherit && i < store->len; i++) {
+    if (!inherit_section(conf, store->order[i])) {
+      conf->handler_failed = true;
+      return false;
+    }
+  }
+  for (size_t i = 0; i < store->len; i++) {
+    store_section *sec = store->order[i];
+    /* Keys before the first section are left for `bind_entry` to reject,
+     * which it only does when no section array is current */
+    if (!*sec->name) {
+      conf->sec_var = conf->keys_var = conf->int_var = NULL;
+    } else if (!add_entry(conf, sec->name, NULL, NULL, sec->lineno)) {
+      return false;
+    }
+    for (store_entry *entry = sec->entries; entry; entry = entry->next) {
+      if (conf->resolve && !resolve_entry(conf, sec->name, entry)) {
+        conf->handler_failed = true;
+        return false;
+      }
+      if (!add_entry(conf, sec->name, entry->name, entry->value,
+                     entry->lineno)) {
+        return false;
+      }
+      if (conf->prov_var) {
+        char *key = join_name(sec->name, conf->flat_sep, entry->name);
+        bind_assoc_variable(conf->prov_var, conf->prov_var->name, key,
+                            (char *)entry->layer, 0);
+      }
+    }
+  }
+  return true;
+}
+
+/* Stores an entry of a `[CHILD : PARENT, ...]` section under `CHILD`, and
+ * for the section itself records the parents */
+static bool store_inherited(ini_conf *conf, const char *section,
+                            const char *name, const char *value, int lineno) {
+  const char *colon = strchr(section, ':');
+  if (!colon) {
+    store_add(conf->store, section, name, value, conf->layer, lineno);
+    return true;
+  }
+  char *child = trim_copy(section, colon);
+  if (!*child) {
+    builtin_error("%s:%d: [%s]: missing section name", conf->layer, lineno,
+                  section);
+    free(child);
+    conf->handler_failed = true;
+    return false;
+  }
+  store_section *sec =
+      store_add(conf->store, child, name, value, conf->layer, lineno);
+  free(child);
+  if (name) {
+    return true;
+  }
+  for (const char *parent = colon + 1; *parent;) {
+    const char *end = parent + strcspn(parent, ",");
+    char *copy = trim_copy(parent, end);
+    if (*copy) {
+      sec->parents =
+          xrealloc(sec->parents, (sec->parents_len + 1) * sizeof(char *));
+      sec->parents[sec->parents_len++] = copy;
+    } else {
+      free(copy);
+    }
+    parent = *end ? end + 1 : end;
+  }
+  return true;
+}
+
+/* Adds an entry, or with `-O` merges it into the store */
+static bool handle_entry(ini_conf *conf, const char *section, const char *name,
+                         const char *value, int lineno) {
+  if (conf->inherit) {
+    return store_inherited(conf, section, name, value, lineno);
+  }
+  if (conf->store) {
+    store_add(conf->store, section, name, value, conf->layer, lineno);
+    return true;
+  }
+  return add_entry(conf, section, name, value, lineno);
+}
+
+/* Decodes a value, or a continuation line of it, onto the end of the value
+ * buffer. A leading quote is dropped here and the closing one when the entry
+ * is complete, `\n`, `\t`, `\r`, `\\`, `\;` and escaped quotes are decoded
+ * and any other backslash is kept */
+static void add_value(ini_conf *conf, const char *value, bool first) {
+  size_t len = strlen(value);
+  /* Room for the newline, the NUL and the opening quote that flush_pending
+   * puts back when the value is unterminated */
+  if (conf->value_len + len + 3 > conf->value_size) {
+    conf->value_size = conf->value_size ? conf->value_size : 256;
+    while (conf->value_len + len + 3 > conf->value_size) {
+      conf->value_size *= 2;
+    }
+    conf->value = xrealloc(conf->value, conf->value_size);
+  }
+  char *out = conf->value + conf->value_len;
+  if (first) {
+    conf->quote = *value == '"' || *value == '\'' ? *value++ : '\0';
+  } else {
+    *out++ = '\n';
+  }
+  conf->last_escaped = false;
+  for (; *value; value++) {
+    if (*value != '\\' || !value[1]) {
+      *out++ = *value;
+      conf->last_escaped = false;
+      continue;
+    }
+    switch (*++value) {
+    case 'n':
+      *out++ = '\n';
+      break;
+    case 't':
+      *out++ = '\t';
+      break;
+    case 'r':
+      *out++ = '\r';
+      break;
+    case '\\':
+    case '"':
+    case '\'':
+    case ';':
+      *out++ = *value;
+      break;
+    default:
+      *out++ = '\\';
+      *out++ = *value;
+    }
+    conf->last_escaped = true;
+  }
+  *out = '\0';
+  conf->value_len = out - conf->value;
+}
+
+/* Adds the entry whose value is being decoded, if there is one */
+static bool flush_pending(ini_conf *conf) {
+  if (!conf->pending_name) {
+    return true;
+  }
+  char *value = conf->value;
+  if (conf->quote) {
+    if (conf->value_len && value[conf->value_len - 1] == conf->quote &&
+        !conf->last_escaped) {
+      value[--conf->value_len] = '\0';
+    } else {
+      /* Unterminated, so the opening quote is part of the value */
+      memmove(value + 1, value, conf->value_len + 1);
+      value[0] = conf->quote;
+    }
+  }
+  bool ok = handle_entry(conf, conf->pending_section, conf->pending_name,
+                         value, conf->pending_lineno);
+  free(conf->pending_section);
+  free(conf->pending_name);
+  conf->pending_section = conf->pending_name = NULL;
+  conf->value_len = 0;
+  return ok;
+}
+
+/* Returns `str` lowercased in `*buf`, which is grown as needed */
+static const char *lower_copy(char **buf, size_t *size, const char *str) {
+  size_t len = strlen(str);
+  if (len + 1 > *size) {
+    *size = (len + 1) * 2;
+    *buf = xrealloc(*buf, *size);
+  }
+  for (size_t i = 0; i <= len; i++) {
+    (*buf)[i] = tolower((unsigned char)str[i]);
+  }
+  return *buf;
+}
+
+/* Returns false when a key is dropped by `-K`, or not kept by `-k` */
+static bool key_wanted(ini_conf *conf, const char *name) {
+  for (size_t i = 0; i < conf->drop_globs_len; i++) {
+    if (fnmatch(conf->drop_globs[i], name, 0) == 0) {
+      return false;
+    }
+  }
+  for (size_t i = 0; i < conf->keep_globs_len; i++) {
+    if (fnmatch(conf->keep_globs[i], name, 0) == 0) {
+      return true;
+    }
+  }
+  return conf->keep_globs_len == 0;
+}
+
+static int handler(void *user, const char *section, const char *name,
+                   const char *value, int lineno) {
+  ini_conf *conf = (ini_conf *)user;
+  /* Names are normalized and filtered before anything is copied or bound */
+  if (conf->lowercase) {
+    section = lower_copy(&conf->lower_section, &conf->lower_section_size,
+                         section);
+    if (name) {
+      name = lower_copy(&conf->lower_name, &conf->lower_name_size, name);
+    }
+  }
+  if (name && !key_wanted(conf, name)) {
+    /* A dropped key ends the value being decoded, and its continuation lines
+     * are dropped with it, as inih passes them under the same name */
+    if (conf->multiline && !conf->reader->indented) {
+      return flush_pending(conf);
+    }
+    return 1;
+  }
+  if (!conf->multiline) {
+    return handle_entry(conf, section, name, value, lineno);
+  }
+  /* inih passes each continuation line as a new value of the same key, only
+   * the reader knows the line was indented */
+  if (name && conf->pending_name && conf->reader->indented) {
+    add_value(conf, value, false);
+    return 1;
+  }
+  if (!flush_pending(conf)) {
+    return 0;
+  }
+  if (!name) {
+    return handle_entry(conf, section, name, value, lineno);
+  }
+  conf->pending_section = savestring(section);
+  conf->pending_name = savestring(name);
+  conf->pending_lineno = lineno;
+  add_value(conf, value, true);
+  return 1;
+}
+
+/* Creates the TOC array and, with `-o`, the section order array. In flat mode
+ * the integer array is also made here */
+static bool make_toc(ini_conf *conf) {
+  conf->toc_var = make_assoc(conf, conf->toc_var_name, true);
+  if (!conf->toc_var) {
+    builtin_error("Could not make %s", conf->toc_var_name);
+    return false;
+  }
+  if (conf->order) {
+    char *order_var_name = join_name(conf->toc_var_name, "__", "order");
+    conf->order_var = make_array(conf, order_var_name);
+    if (!conf->order_var) {
+      builtin_error("Could not make %s", order_var_name);
+      free(order_var_name);
+      return false;
+    }
+    free(order_var_name);
+  }
+  /* Flat mode keeps its integers in a single <TOC>__int array */
+  if (conf->flat && (conf->int_auto || conf->int_keys_len)) {
+    char *int_var_name = join_name(conf->toc_var_name, "__", "int");
+    conf->int_var = make_assoc(conf, int_var_name, true);
+    if (!conf->int_var) {
+      builtin_error("Could not make %s", int_var_name);
+      free(int_var_name);
+      return false;
+    }
+    VSETATTR(conf->int_var, att_integer);
+    free(int_var_name);
+  }
+  return true;
+}
+
+/* A file checked by `ini -n` and the errors found in it */
+typedef struct {
+  const char *path;
+  char **errors;
+  size_t errors_len;
+} check_file;
+
+/* The files shared by the threads of `ini -n` */
+typedef struct {
+  check_file *files;
+  size_t len;
+  atomic_size_t next; /* The next file to be checked */
+  const char *prefix; /* Prepended to section names, as the TOC would be */
+  bool mangle;        /* `-M`, any section name is made legal */
+} check_pool;
+
+/* User data for the inih handler of `ini -n` */
+typedef struct {
+  check_file *file;
+  const char *prefix;
+  bool mangle;
+  int line_offset; /* Lines before the chunk being parsed */
+  bool in_section;
+} check_state;
+
+/* Appends a formatted error to a checked file. This runs on the worker
+ * threads, so it must not call into Bash, an error that cannot be allocated
+ * is dropped */
+static void check_error(check_file *file, const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  int len = vsnprintf(NULL, 0, fmt, args);
+  va_end(args);
+  char *msg = malloc(len + 1);
+  char **errors =
+      realloc(file->errors, (file->errors_len + 1) * sizeof(char *));
+  if (!msg || !errors) {
+    free(msg);
+    return;
+  }
+  va_start(args, fmt);
+  vsnprintf(msg, len + 1, fmt, args);
+  va_end(args);
+  file->errors = errors;
+  file->errors[file->errors_len++] = msg;
+}
+
+/* The inih handler of `ini -n`, it applies the checks `bind_entry` would but
+ * records every error and carries on */
+static int check_handler(void *user, const char *section, const char *name,
+                         const char *value, int lineno) {
+  check_state *state = (check_state *)user;
+  lineno += state->line_offset;
+  if (!name && !value && state->mangle) {
+    state->in_section = true;
+    return 1;
+  }
+  if (!name && !value) {
+    size_t prefix_len = strlen(state->prefix);
+    size_t sec_len = strlen(section);
+    char *sec_var_name = malloc(prefix_len + sec_len + 2);
+    if (!sec_var_name) {
+      return 1;
+    }
+    char *end = sec_var_name;
+    if (prefix_len) {
+      memcpy(end, state->prefix, prefix_len);
+      end += prefix_len;
+      *end++ = '_';
+    }
+    memcpy(end, section, sec_len + 1);
+    if (!legal_identifier(sec_var_name)) {
+      check_error(state->file, "%s:%d: `%s': not a valid identifier",
+                  state->file->path, lineno, sec_var_name);
+    }
+    free(sec_var_name);
+    state->in_section = true;
+    return 1;
+  }
+  if (!state->in_section) {
+    check_error(state->file, "%s:%d: %s is outside of a section",
+                state->file->path, lineno, name);
+  }
+  return 1;
+}
+
+/* Reads a whole file, decompressed, into a NUL terminated buffer. Returns
+ * NULL and sets `error` when it cannot be read */
+static char *read_file(const char *path, const char **error) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    *error = strerror(errno);
+    return NULL;
+  }
+  fd_reader reader = {.fd = fd, .buf = malloc(READ_BUF_SIZE)};
+  char *buf = NULL;
+  size_t len = 0;
+  ssize_t n = -1;
+  errno = ENOMEM;
+  while (reader.buf && (n = read_input(&reader)) > 0) {
+    char *grown = realloc(buf, len + n + 1);
+    if (!grown) {
+      errno = ENOMEM;
+      n = -1;
+      break;
+    }
+    buf = grown;
+    memcpy(buf + len, reader.buf, n);
+    len += n;
+  }
+  if (n < 0) {
+    *error = reader.decode_error ? reader.decode_error : strerror(errno);
+    free(buf);
+    buf = NULL;
+  } else if (!buf) {
+    buf = calloc(1, 1);
+    *error = strerror(ENOMEM);
+  } else {
+    buf[len] = '\0';
+  }
+  free_reader(&reader);
+  free(reader.buf);
+  close(fd);
+  return buf;
+}
+
+/* Checks one file. inih stops at a syntax error, so parsing resumes on the
+ * line after it and every error in the file is found */
+static void check_one(check_file *file, const check_pool *pool) {
+  const char *error;
+  char *buf = read_file(file->path, &error);
+  if (!buf) {
+    check_error(file, "%s: %s", file->path, error);
+    return;
+  }
+  /* Directives such as `!include` are blanked, they are run by the parse */
+  for (char *line = buf; line; line = strchr(line, '\n')) {
+    line += *line == '\n';
+    if (*line == '!') {
+      memset(line, ' ', strcspn(line, "\n"));
+    }
+  }
+  check_state state = {
+      .file = file, .prefix = pool->prefix, .mangle = pool->mangle};
+  char *chunk = buf;
+  for (;;) {
+    int ret = ini_parse_string(chunk, check_handler, &state);
+    if (ret < 0) {
+      check_error(file, "%s: out of memory", file->path);
+    }
+    if (ret <= 0) {
+      break;
+    }
+    check_error(file, "%s:%d: syntax error", file->path,
+                state.line_offset + ret);
+    for (int i = 0; i < ret && chunk; i++) {
+      chunk = strchr(chunk, '\n');
+      chunk = chunk ? chunk + 1 : NULL;
+    }
+    if (!chunk) {
+      break;
+    }
+    state.line_offset += ret;
+  }
+  free(buf);
+}
+
+/* Starts a helper thread with every signal blocked. Bash only masks signals
+ * such as SIGCHLD on its own thread, so an unmasked helper would take them
+ * and run Bash's handlers alongside it */
+static int start_thread(pthread_t *thread, void *(*body)(void *), void *arg) {
+  sigset_t all, saved;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &saved);
+  int ret = pthread_create(thread, NULL, body, arg);
+  pthread_sigmask(SIG_SETMASK, &saved, NULL);
+  return ret;
+}
+
+/* The body of each `ini -n` thread, it takes files until none are left */
+static void *check_worker(void *arg) {
+  check_pool *pool = (check_pool *)arg;
+  size_t i;
+  while ((i = atomic_fetch_add(&pool->next, 1)) < pool->len) {
+    check_one(&pool->files[i], pool);
+  }
+  return NULL;
+}
+
+/* Checks every `-f` and `-D` file on a pool of threads, one per CPU, and
+ * collects the errors of all of them in file order */
+static int check_files(ini_conf *conf) {
+  check_pool pool = {0};
+  pool.len = conf->paths_len;
+  pool.files = xmalloc((pool.len + 1) * sizeof(check_file));
+  memset(pool.files, 0, (pool.len + 1) * sizeof(check_file));
+  for (size_t i = 0; i < pool.len; i++) {
+    pool.files[i].path = conf->paths[i];
+  }
+  pool.prefix = conf->toc_var_name ? conf->toc_var_name : "";
+  pool.mangle = conf->mangle;
+  atomic_init(&pool.next, 0);
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t nthreads = cpus > 1 ? (size_t)cpus - 1 : 0;
+  if (nthreads > pool.len) {
+    nthreads = pool.len;
+  }
+  /* A Bash built with its own malloc, which is not thread safe, exports
+   * sh_malloc. The checks then all run on this thread */
+  if (dlsym(RTLD_DEFAULT, "sh_malloc")) {
+    nthreads = 0;
+  }
+  pthread_t *threads = xmalloc((nthreads + 1) * sizeof(pthread_t));
+  size_t started = 0;
+  while (started < nthreads &&
+         start_thread(&threads[started], check_worker, &pool) == 0) {
+    started++;
+  }
+  /* This thread takes its share of the files too */
+  check_worker(&pool);
+  for (size_t i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+  for (size_t i = 0; i < pool.len; i++) {
+    check_file *file = &pool.files[i];
+    for (size_t j = 0; j < file->errors_len; j++) {
+      if (conf->errors_var) {
+        append_array(conf->errors_var, file->errors[j]);
+      } else {
+        builtin_error("%s", file->errors[j]);
+      }
+      conf->error_count++;
+      free(file->errors[j]);
+    }
+    free(file->errors);
+  }
+  free(pool.files);
+  return conf->error_count ? EXECUTION_FAILURE : EXECUTION_SUCCESS;
+}
+
+/* Adds a file to parse */
+static void add_path(ini_conf *conf, char *path) {
+  conf->paths = xrealloc(conf->paths, (conf->paths_len + 1) * sizeof(char *));
+  conf->paths[conf->paths_len++] = path;
+}
+
+/* Used with scandir to pick the .ini files of a directory */
+static int is_ini_file(const struct dirent *entry) {
+  size_t len = strlen(entry->d_name);
+  return len > 4 && entry->d_name[0] != '.' &&
+         strcmp(entry->d_name + len - 4, ".ini") == 0;
+}
+
+/* Adds the .ini files of `dir` to parse, sorted by name */
+static bool add_dir(ini_conf *conf, const char *dir) {
+  struct dirent **entries;
+  int n = scandir(dir, &entries, is_ini_file, alphasort);
+  if (n < 0) {
+    builtin_error("%s: %s", dir, strerror(errno));
+    return false;
+  }
+  for (int i = 0; i < n; i++) {
+    add_path(conf, join_name(dir, "/", entries[i]->d_name));
+    free(entries[i]);
+  }
+  free(entries);
+  return true;
+}
+
+/* Adds a `-T section.key=TYPE` spec to the typed keys */
+static bool add_type_spec(ini_conf *conf, const char *spec) {
+  const char *type = strrchr(spec, '=');
+  if (!type || type == spec) {
+    builtin_error("%s: invalid type specification", spec);
+    return false;
+  }
+  if (strcmp(type + 1, "int") != 0) {
+    builtin_error("%s: unknown type `%s'", spec, type + 1);
+    return false;
+  }
+  size_t key_len = type - spec;
+  char *key = xmalloc(key_len + 1);
+  memcpy(key, spec, key_len);
+  key[key_len] = '\0';
+  conf->int_keys =
+      xrealloc(conf->int_keys, (conf->int_keys_len + 1) * sizeof(char *));
+  conf->int_keys[conf->int_keys_len++] = key;
+  return true;
+}
+
+/* Frees everything the ini builtin allocated while parsing its args */
+static void free_conf(ini_conf *conf) {
+  for (size_t i = 0; i < conf->int_keys_len; i++) {
+    free(conf->int_keys[i]);
+  }
+  free(conf->int_keys);
+  for (size_t i = 0; i < conf->list_keys_len; i++) {
+    free(conf->list_keys[i]);
+  }
+  free(conf->list_keys);
+  for (size_t i = 0; i < conf->keep_globs_len; i++) {
+    free(conf->keep_globs[i]);
+  }
+  free(conf->keep_globs);
+  for (size_t i = 0; i < conf->drop_globs_len; i++) {
+    free(conf->drop_globs[i]);
+  }
+  free(conf->drop_globs);
+  free(conf->lower_section);
+  free(conf->lower_name);
+  if (conf->lists) {
+    hash_flush(conf->lists, NULL);
+    hash_dispose(conf->lists);
+  }
+  if (conf->exported) {
+    hash_flush(conf->exported, NULL);
+    hash_dispose(conf->exported);
+  }
+  dispose_words(conf->batch);
+  free(conf->schema_seen);
+  for (size_t i = 0; i < conf->paths_len; i++) {
+    free(conf->paths[i]);
+  }
+  free(conf->paths);
+  free(conf->pending_section);
+  free(conf->pending_name);
+  free(conf->value);
+  if (conf->store) {
+    store_free(conf->store);
+  }
+  if (conf->included) {
+    hash_flush(conf->included, NULL);
+    hash_dispose(conf->included);
+  }
+  free(conf->include_stack);
+  if (conf->shadows) {
+    hash_flush(conf->shadows, NULL);
+    hash_dispose(conf->shadows);
+    free(conf->toc_var_name);
+  }
+}
+
+static bool run_directive(void *user, char *line);
+
+/* Parses the config read from `fd`, returns the inih result. For `-H` each
+ * file is hashed on its own, and its hash is added to the input hash after
+ * the hashes of the files it includes. `ini -A` reads the files before their
+ * includes, so this keeps the input hash the same */
+static int parse_fd(ini_conf *conf, int fd) {
+  if (!read_buf) {
+    read_buf = xmalloc(READ_BUF_SIZE);
+  }
+  bool shared = !read_buf_busy;
+  xxh_state file_hash;
+  xxh_init(&file_hash);
+  fd_reader reader = {.fd = fd,
+                      .buf = shared ? read_buf : xmalloc(READ_BUF_SIZE),
+                      .line_start = true,
+                      .directive = run_directive,
+                      .user = conf,
+                      .hash = conf->hash_var ? &file_hash : NULL};
+  read_buf_busy = true;
+  fd_reader *outer = conf->reader;
+  conf->reader = &reader;
+  int ret = ini_parse_stream(read_line, &reader, handler, conf);
+  int lineno = conf->pending_lineno;
+  if (ret == 0 && !flush_pending(conf)) {
+    ret = lineno;
+  }
+  if (ret == 0 && reader.failed) {
+    /* The directive reported its own error */
+    conf->handler_failed = true;
+    ret = reader.lineno;
+  }
+  conf->reader = outer;
+  if (conf->hash_var) {
+    xxh_update_u64(&conf->input_hash, xxh_digest(&file_hash));
+  }
+  free_reader(&reader);
+  if (shared) {
+    read_buf_busy = false;
+  } else {
+    free(reader.buf);
+  }
+  if (ret == 0 && reader.error) {
+    if (conf->path) {
+      builtin_error("%s: read error: %s", conf->path, read_error(&reader));
+    } else {
+      builtin_error("%d: read error: %s", fd, read_error(&reader));
+    }
+    ret = -1;
+  } else if (ret < 0) {
+    builtin_error("Unable to read from fd: %d", fd);
+  }
+  return ret;
+}
+
+/* Records a file as parsed, returns false if it already was. The table maps
+ * the real path of each file to the path it was named by */
+static bool add_included(ini_conf *conf, const char *real, const char *path) {
+  if (!conf->included) {
+    conf->included = hash_create(16);
+  }
+  if (hash_search(real, conf->included, 0)) {
+    return false;
+  }
+  hash_insert(savestring(real), conf->included, HASH_NOSRCH)->data =
+      savestring(path);
+  return true;
+}
+
+/* Parses an included file, unless it was parsed already. A file that is
+ * still being parsed is an include cycle */
+static bool include_file(ini_conf *conf, const char *path) {
+  const char *includer = conf->layer;
+  int lineno = conf->reader->lineno;
+  char *real = realpath(path, NULL);
+  if (!real) {
+    builtin_error("%s:%d: %s: %s", includer, lineno, path, strerror(errno));
+    return false;
+  }
+  for (size_t i = 0; i < conf->include_len; i++) {
+    if (strcmp(conf->include_stack[i], real) == 0) {
+      builtin_error("%s:%d: %s: include cycle", includer, lineno, path);
+      free(real);
+      return false;
+    }
+  }
+  if (!add_included(conf, real, path)) {
+    free(real);
+    return true;
+  }
+  int fd = open(real, O_RDONLY);
+  if (fd < 0) {
+    builtin_error("%s:%d: %s: %s", includer, lineno, path, strerror(errno));
+    free(real);
+    return false;
+  }
+  /* The included file's sections must not leak into the including one */
+  const char *saved_path = conf->path;
+  const char *saved_layer = conf->layer;
+  SHELL_VAR *sec_var = conf->sec_var;
+  SHELL_VAR *keys_var = conf->keys_var;
+  SHELL_VAR *int_var = conf->int_var;
+  conf->path = conf->layer =
+      (char *)hash_search(real, conf->included, 0)->data;
+  conf->include_stack = xrealloc(conf->include_stack,
+                                 (conf->include_len + 1) * sizeof(char *));
+  conf->include_stack[conf->include_len++] = real;
+  /* Keys before its first section are outside of any, as in any file */
+  conf->sec_var = conf->keys_var = conf->int_var = NULL;
+  int ret = parse_fd(conf, fd);
+  conf->include_len--;
+  close(fd);
+  if (ret > 0 && !conf->handler_failed) {
+    builtin_error("Malformed ini, syntax error on line %d of %s", ret,
+                  conf->path);
+    conf->handler_failed = true;
+  }
+  conf->path = saved_path;
+  conf->layer = saved_layer;
+  conf->sec_var = sec_var;
+  conf->keys_var = keys_var;
+  conf->int_var = int_var;
+  free(real);
+  return ret == 0;
+}
 
-/* This is the inih handler called for every new section and for every name and
- * value in a section. This function creates and populates our associative
- * arrays in Bash. Both for the TOC array as well as for the individual section
- * arrays, <TOC>_<INI_SECTION_NAME> */
-static int handler(void *user, const char *section, const char *name,
-                   const char *value) {
+/* Runs an `!include PATH` or `!include_dir DIR` line. A relative path is
+ * resolved against the directory of the including file */
+static bool run_directive(void *user, char *line) {
   ini_conf *conf = (ini_conf *)user;
-  char *toc_var_name = conf->toc_var_name;
-  /* Create <TOC>_<INI_SECTION_NAME> */
-  char *sep = "_";
-  size_t sec_size = strlen(toc_var_name) + strlen(section) + strlen(sep) +
-                    1; // +1 for the NUL character
-  char *sec_var_name = xmalloc(sec_size);
-  char *sec_end = sec_var_name + sec_size - 1;
-  char *p = memccpy(sec_var_name, toc_var_name, '\0', sec_size);
-  if (!p) {
-    builtin_error("Unable to create section name");
-    return 0;
+  size_t word_len = strcspn(line, " \t\r\n");
+  char *arg = line + word_len;
+  arg += strspn(arg, " \t");
+  char *end = arg + strlen(arg);
+  while (end > arg && isspace((unsigned char)end[-1])) {
+    *--end = '\0';
   }
-  p = memccpy(p - 1, sep, '\0', sec_end - p + 2);
-  if (!p) {
-    builtin_error("Unable to create section name");
-    return 0;
+  bool dir;
+  if (word_len == 8 && strncmp(line, "!include", 8) == 0) {
+    dir = false;
+  } else if (word_len == 12 && strncmp(line, "!include_dir", 12) == 0) {
+    dir = true;
+  } else {
+    builtin_error("%s:%d: %.*s: unknown directive", conf->layer,
+                  conf->reader->lineno, (int)word_len, line);
+    return false;
   }
-  p = memccpy(p - 1, section, '\0', sec_end - p + 2);
-  if (!p) {
-    builtin_error("Unable to create section name");
-    return 0;
+  if (!*arg) {
+    builtin_error("%s:%d: %.*s needs a path", conf->layer, conf->reader->lineno,
+                  (int)word_len, line);
+    return false;
   }
-  if (!legal_identifier(sec_var_name)) {
-    sh_invalidid(sec_var_name);
-    free(sec_var_name);
-    return 0;
+  /* An entry being decoded belongs before the included ones */
+  if (!flush_pending(conf)) {
+    return false;
   }
-  /* New section parsed */
-  if (!name && !value) {
-    SHELL_VAR *toc_var = find_variable(toc_var_name);
-    if (!toc_var) {
-      free(sec_var_name);
-      builtin_error("Could not find %s", toc_var_name);
-      return 0;
-    }
-    bind_assoc_variable(toc_var, toc_var_name, strdup(section), "true", 0);
-    SHELL_VAR *sec_var = NULL;
-    if (conf->local_vars) {
-      int vflags = 0;
-      sec_var = make_local_assoc_variable(sec_var_name, vflags);
-    } else {
-      sec_var = make_new_assoc_variable(sec_var_name);
+  char *path;
+  const char *slash = conf->path ? strrchr(conf->path, '/') : NULL;
+  if (*arg == '/' || !slash) {
+    path = savestring(arg);
+  } else {
+    path = xmalloc(slash - conf->path + strlen(arg) + 2);
+    memcpy(path, conf->path, slash - conf->path + 1);
+    strcpy(path + (slash - conf->path) + 1, arg);
+  }
+  if (!dir) {
+    bool ok = include_file(conf, path);
+    free(path);
+    return ok;
+  }
+  struct dirent **entries;
+  int n = scandir(path, &entries, is_ini_file, alphasort);
+  if (n < 0) {
+    builtin_error("%s:%d: %s: %s", conf->layer, conf->reader->lineno, path,
+                  strerror(errno));
+    free(path);
+    return false;
+  }
+  bool ok = true;
+  for (int i = 0; i < n; i++) {
+    if (ok) {
+      char *file = join_name(path, "/", entries[i]->d_name);
+      ok = include_file(conf, file);
+      free(file);
     }
-    if (!sec_var) {
-      builtin_error("Could not make %s", sec_var_name);
-      free(sec_var_name);
-      return 0;
+    free(entries[i]);
+  }
+  free(entries);
+  free(path);
+  return ok;
+}
+
+/* Makes `path` the `-f` or `-D` file being parsed. Returns its real path,
+ * the first entry of the include stack, to be freed once it is parsed */
+static char *begin_file(ini_conf *conf, const char *path) {
+  conf->path = conf->layer = path;
+  /* As inih does, every file starts outside of a section */
+  conf->sec_var = conf->keys_var = conf->int_var = NULL;
+  /* Including a file given here parses it again only as a cycle */
+  char *real = realpath(path, NULL);
+  if (real) {
+    add_included(conf, real, path);
+    conf->include_stack = xrealloc(conf->include_stack, sizeof(char *));
+    conf->include_stack[0] = real;
+    conf->include_len = 1;
+  }
+  return real;
+}
+
+/* Parses the config from the `-f` and `-D` files, or else from `fd`. Returns
+ * the inih result of the first file that failed */
+static int parse_input(ini_conf *conf, int fd) {
+  if (!conf->paths_len) {
+    conf->layer = "-";
+    return parse_fd(conf, fd);
+  }
+  for (size_t i = 0; i < conf->paths_len; i++) {
+    fd = open(conf->paths[i], O_RDONLY);
+    if (fd < 0) {
+      builtin_error("%s: %s", conf->paths[i], strerror(errno));
+      return -1;
+    }
+    char *real = begin_file(conf, conf->paths[i]);
+    int ret = parse_fd(conf, fd);
+    conf->include_len = 0;
+    free(real);
+    close(fd);
+    if (ret != 0) {
+      return ret;
     }
-    free(sec_var_name);
-    return 1;
   }
-  if (!name) {
-    free(sec_var_name);
-    builtin_error("Malformed ini, name is NULL!");
-    return 0;
+  return 0;
+}
+
+/* The kinds of the records of an `ini -A` job */
+typedef enum {
+  JOB_FILE,      /* A `-f` or `-D` file starts */
+  JOB_SECTION,   /* A section header */
+  JOB_ENTRY,     /* A key and value */
+  JOB_DIRECTIVE, /* A `!` directive line, run when the records are bound */
+  JOB_ERROR      /* The read stopped, at the syntax error on line `lineno` */
+} job_kind;
+
+/* What inih passed to the handler. The strings are offsets into the job's
+ * string buffer, NO_STRING for none */
+typedef struct {
+  job_kind kind;
+  bool indented;
+  int lineno;
+  size_t name; /* Also the path of a file, a directive or an error message */
+  size_t value;
+} job_record;
+
+#define NO_STRING SIZE_MAX
+
+/* An `ini -A` job. Its thread reads and tokenizes the input into records,
+ * `ini_wait` then binds them on the shell's thread. The thread must not call
+ * into Bash, so it only uses malloc(3) */
+typedef struct ini_job {
+  struct ini_job *next;
+  char *id;
+  char **paths;
+  char **real_paths; /* The paths made absolute, a `cd` must not move them */
+  size_t paths_len;
+  int fd;    /* A copy of the input FD, unless reading files */
+  pid_t pid; /* The process that started the thread */
+  pthread_t thread;
+  bool threaded;
+  atomic_bool done; /* The records are complete */
+  fd_reader *reader;
+  job_record *records;
+  size_t len;
+  size_t size;
+  char *strings;
+  size_t strings_len;
+  size_t strings_size;
+  bool oom;
+  uint64_t *file_hashes; /* The hash of each file read, for `-H` */
+} ini_job;
+
+/* The jobs started and not yet waited for */
+static ini_job *jobs;
+
+/* Copies a string to the job's string buffer, returns its offset */
+static size_t job_string(ini_job *job, const char *str) {
+  if (!str || job->oom) {
+    return NO_STRING;
   }
-  if (!value) {
-    free(sec_var_name);
-    builtin_error("Malformed ini, value is NULL!");
+  size_t len = strlen(str) + 1;
+  if (job->strings_len + len > job->strings_size) {
+    size_t size = job->strings_size ? job->strings_size : READ_BUF_SIZE;
+    while (job->strings_len + len > size) {
+      size *= 2;
+    }
+    char *strings = realloc(job->strings, size);
+    if (!strings) {
+      job->oom = true;
+      return NO_STRING;
+    }
+    job->strings = strings;
+    job->strings_size = size;
+  }
+  memcpy(job->strings + job->strings_len, str, len);
+  job->strings_len += len;
+  return job->strings_len - len;
+}
+
+/* Appends a record, returns 0, stopping inih, if it could not be */
+static int job_add(ini_job *job, job_kind kind, int lineno, const char *name,
+                   const char *value) {
+  if (job->len == job->size && !job->oom) {
+    size_t size = job->size ? job->size * 2 : 1024;
+    job_record *records = realloc(job->records, size * sizeof(job_record));
+    if (!records) {
+      job->oom = true;
+    } else {
+      job->records = records;
+      job->size = size;
+    }
+  }
+  job_record rec = {.kind = kind,
+                    .indented = job->reader && job->reader->indented,
+                    .lineno = lineno,
+                    .name = job_string(job, name),
+                    .value = job_string(job, value)};
+  if (job->oom) {
     return 0;
   }
-  SHELL_VAR *sec_var = find_variable(sec_var_name);
-  bind_assoc_variable(sec_var, sec_var_name, strdup(name), strdup(value), 0);
-  free(sec_var_name);
+  job->records[job->len++] = rec;
   return 1;
 }
 
+/* The inih handler of the job thread */
+static int job_handler(void *user, const char *section, const char *name,
+                       const char *value, int lineno) {
+  ini_job *job = (ini_job *)user;
+  if (!name && !value) {
+    return job_add(job, JOB_SECTION, lineno, section, NULL);
+  }
+  return job_add(job, JOB_ENTRY, lineno, name, value);
+}
+
+static bool job_directive(void *user, char *line) {
+  ini_job *job = (ini_job *)user;
+  return job_add(job, JOB_DIRECTIVE, job->reader->lineno, line, NULL);
+}
+
+/* Records an error that stopped the read, formatted as `ini` reports it */
+static void job_error(ini_job *job, const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  int len = vsnprintf(NULL, 0, fmt, args);
+  va_end(args);
+  char *msg = malloc(len + 1);
+  if (!msg) {
+    job->oom = true;
+    return;
+  }
+  va_start(args, fmt);
+  vsnprintf(msg, len + 1, fmt, args);
+  va_end(args);
+  job_add(job, JOB_ERROR, -1, msg, NULL);
+  free(msg);
+}
+
+/* Reads and tokenizes the job's input into records */
+static void job_read(ini_job *job) {
+  size_t files = job->paths_len ? job->paths_len : 1;
+  char *buf = malloc(READ_BUF_SIZE);
+  if (!buf) {
+    job->oom = true;
+    return;
+  }
+  for (size_t i = 0; i < files; i++) {
+    const char *path = job->paths_len ? job->paths[i] : NULL;
+    int fd = job->fd;
+    if (path) {
+      job_add(job, JOB_FILE, 0, path, job->real_paths[i]);
+      fd = open(job->real_paths[i], O_RDONLY);
+      if (fd < 0) {
+        job_error(job, "%s: %s", path, strerror(errno));
+        break;
+      }
+    }
+    xxh_state file_hash;
+    xxh_init(&file_hash);
+    fd_reader reader = {.fd = fd,
+                        .buf = buf,
+                        .line_start = true,
+                        .directive = job_directive,
+                        .user = job,
+                        .hash = &file_hash};
+    job->reader = &reader;
+    int ret = ini_parse_stream(read_line, &reader, job_handler, job);
+    job->reader = NULL;
+    job->file_hashes[i] = xxh_digest(&file_hash);
+    free_reader(&reader);
+    if (path) {
+      close(fd);
+    }
+    if (ret < 0 || job->oom) {
+      job->oom = true;
+      break;
+    }
+    if (ret > 0) {
+      job_add(job, JOB_ERROR, ret, NULL, NULL);
+      break;
+    }
+    if (reader.error) {
+      if (path) {
+        job_error(job, "%s: read error: %s", path, read_error(&reader));
+      } else {
+        job_error(job, "%d: read error: %s", job->fd, read_error(&reader));
+      }
+      break;
+    }
+  }
+  free(buf);
+}
+
+static void *job_thread(void *arg) {
+  ini_job *job = (ini_job *)arg;
+  job_read(job);
+  atomic_store(&job->done, true);
+  return NULL;
+}
+
+static void free_job(ini_job *job) {
+  for (size_t i = 0; i < job->paths_len; i++) {
+    free(job->paths[i]);
+    if (job->real_paths) {
+      free(job->real_paths[i]);
+    }
+  }
+  free(job->paths);
+  free(job->real_paths);
+  if (job->fd >= 0) {
+    close(job->fd);
+  }
+  free(job->records);
+  free(job->file_hashes);
+  free(job->strings);
+  free(job->id);
+  free(job);
+}
+
+/* Starts `ini -A JOBID`, reading the `-f` and `-D` files or else `fd` */
+static int start_job(ini_conf *conf, const char *id, int fd) {
+  for (ini_job *job = jobs; job; job = job->next) {
+    if (strcmp(job->id, id) == 0) {
+      builtin_error("%s: job already started", id);
+      return EXECUTION_FAILURE;
+    }
+  }
+  ini_job *job = xmalloc(sizeof(ini_job));
+  memset(job, 0, sizeof(ini_job));
+  job->id = savestring(id);
+  job->paths = conf->paths;
+  job->paths_len = conf->paths_len;
+  conf->paths = NULL;
+  conf->paths_len = 0;
+  job->fd = -1;
+  /* Resolved now, the script may change directory before `ini_wait`, and the
+   * `!include` paths are relative to the files */
+  if (job->paths_len) {
+    job->real_paths = xmalloc(job->paths_len * sizeof(char *));
+    memset(job->real_paths, 0, job->paths_len * sizeof(char *));
+  }
+  for (size_t i = 0; i < job->paths_len; i++) {
+    if (!(job->real_paths[i] = realpath(job->paths[i], NULL))) {
+      builtin_error("%s: %s", job->paths[i], strerror(errno));
+      free_job(job);
+      return EXECUTION_FAILURE;
+    }
+  }
+  /* The script may close or reuse the FD before the job is waited for */
+  if (!job->paths_len && (job->fd = dup(fd)) < 0) {
+    builtin_error("%d: %s", fd, strerror(errno));
+    free_job(job);
+    return EXECUTION_FAILURE;
+  }
+  job->pid = getpid();
+  job->file_hashes = xmalloc((job->paths_len ? job->paths_len : 1) *
+                              sizeof(uint64_t));
+  atomic_init(&job->done, false);
+  /* See check_files, without a thread safe malloc the job is read now */
+  if (!dlsym(RTLD_DEFAULT, "sh_malloc") &&
+      start_thread(&job->thread, job_thread, job) == 0) {
+    job->threaded = true;
+  } else {
+    job_read(job);
+    atomic_store(&job->done, true);
+  }
+  job->next = jobs;
+  jobs = job;
+  return EXECUTION_SUCCESS;
+}
+
+/* Takes a job off the list once its records are complete */
+static ini_job *wait_job(const char *id) {
+  ini_job **prev = &jobs;
+  while (*prev && strcmp((*prev)->id, id) != 0) {
+    prev = &(*prev)->next;
+  }
+  ini_job *job = *prev;
+  if (!job) {
+    builtin_error("%s: no such job", id);
+    return NULL;
+  }
+  *prev = job->next;
+  if (job->threaded && job->pid == getpid()) {
+    pthread_join(job->thread, NULL);
+  } else if (!atomic_load(&job->done)) {
+    /* A subshell inherits the job but not its thread. Its records are only
+     * whole if the thread was done before the fork, and the input cannot be
+     * read again, a pipe is drained and an FD shares its offset */
+    builtin_error("%s: still being read when the subshell started", id);
+    free_job(job);
+    return NULL;
+  }
+  return job;
+}
+
+/* Binds the records of an `ini -A` job as if its input was parsed now.
+ * Returns the inih result, like parse_input */
+static int replay_job(ini_conf *conf, ini_job *job) {
+  if (job->oom) {
+    builtin_error("%s: out of memory", job->id);
+    return -1;
+  }
+  fd_reader reader = {0};
+  conf->reader = &reader;
+  conf->layer = "-";
+  const char *section = "";
+  char *real = NULL;
+  size_t hashed = 0; /* The files whose hash was added, as in parse_fd */
+  int ret = 0;
+  for (size_t i = 0; ret == 0 && i < job->len; i++) {
+    job_record *rec = &job->records[i];
+    char *name = rec->name == NO_STRING ? NULL : job->strings + rec->name;
+    char *value = rec->value == NO_STRING ? NULL : job->strings + rec->value;
+    reader.lineno = rec->lineno;
+    reader.indented = rec->indented;
+    switch (rec->kind) {
+    case JOB_FILE:
+      /* As at the end of parse_fd */
+      ret = conf->pending_lineno;
+      if (flush_pending(conf)) {
+        ret = 0;
+      } else {
+        break;
+      }
+      if (i > 0 && conf->hash_var) {
+        xxh_update_u64(&conf->input_hash, job->file_hashes[hashed++]);
+      }
+      free(real);
+      /* Included files are named relative to the absolute path */
+      real = begin_file(conf, value);
+      conf->layer = name;
+      section = "";
+      break;
+    case JOB_SECTION:
+      section = name;
+      if (!handler(conf, section, NULL, NULL, rec->lineno)) {
+        ret = rec->lineno;
+      }
+      break;
+    case JOB_ENTRY:
+      if (!handler(conf, section, name, value, rec->lineno)) {
+        ret = rec->lineno;
+      }
+      break;
+    case JOB_DIRECTIVE:
+      if (!run_directive(conf, name)) {
+        conf->handler_failed = true;
+        ret = rec->lineno;
+      }
+      break;
+    case JOB_ERROR:
+      if (name) {
+        builtin_error("%s", name);
+      }
+      ret = rec->lineno;
+      break;
+    }
+  }
+  int lineno = conf->pending_lineno;
+  if (ret == 0 && !flush_pending(conf)) {
+    ret = lineno;
+  }
+  if (ret == 0 && conf->hash_var) {
+    xxh_update_u64(&conf->input_hash, job->file_hashes[hashed]);
+  }
+  conf->include_len = 0;
+  conf->reader = NULL;
+  free(real);
+  return ret;
+}
+
+/* Adds a hash to the `-H` array, as 16 hex digits */
+static void bind_hash(ini_conf *conf, const char *key, uint64_t hash) {
+  char buf[17];
+  snprintf(buf, sizeof(buf), "%016jx", (uintmax_t)hash);
+  bind_assoc_variable(conf->hash_var, conf->hash_var->name, savestring(key),
+                      buf, 0);
+}
+
 /* This is essentially the main function for the ini builtin, it does arg
  * parsing and then calls the inih function to parse the provided ini FD */
-int ini_builtin(WORD_LIST *list) {
+static int run_ini(WORD_LIST *list, ini_conf *conf) {
   intmax_t intval;
   int opt, code;
   int fd = 0;
   bool global_vars = false;
-  char *toc_var_name = NULL;
+  char *callback_name = NULL;
+  char *schema_path = NULL;
+  char *errors_var_name = NULL;
+  char *prov_var_name = NULL;
+  char *hash_var_name = NULL;
+  bool overlay = false;
+  bool transaction = false;
+  char *job_id = NULL;
+  conf->flat_sep = ".";
+  conf->quantum = 5000;
   reset_internal_getopt();
-  while ((opt = internal_getopt(list, "a:gu:")) != -1) {
+  while ((opt = internal_getopt(list, "A:a:C:c:D:d:Ee:Ff:gH:iIk:K:l:L"
+                                      "MmnOop:P:rRs:S:tT:u:x")) != -1) {
     switch (opt) {
+    case 'A':
+      job_id = list_optarg;
+      break;
     case 'a':
-      toc_var_name = list_optarg;
+      conf->toc_var_name = list_optarg;
+      break;
+    case 'C':
+      callback_name = list_optarg;
+      break;
+    case 'c':
+      code = legal_number(list_optarg, &conf->quantum);
+      if (code == 0 || conf->quantum <= 0) {
+        builtin_error("%s: invalid callback quantum", list_optarg);
+        return EXECUTION_FAILURE;
+      }
+      break;
+    case 'D':
+      if (!add_dir(conf, list_optarg)) {
+        return EXECUTION_FAILURE;
+      }
+      break;
+    case 'd':
+      conf->list_delims = list_optarg;
+      break;
+    case 'E':
+      conf->env_override = true;
+      break;
+    case 'e':
+      errors_var_name = list_optarg;
+      break;
+    case 'F':
+      conf->flat = true;
+      break;
+    case 'f':
+      add_path(conf, savestring(list_optarg));
       break;
     case 'g':
       global_vars = true;
       break;
+    case 'H':
+      hash_var_name = list_optarg;
+      break;
+    case 'i':
+      conf->inherit = true;
+      break;
+    case 'I':
+      conf->int_auto = true;
+      break;
+    case 'k':
+      conf->keep_globs = xrealloc(conf->keep_globs,
+                                  (conf->keep_globs_len + 1) * sizeof(char *));
+      conf->keep_globs[conf->keep_globs_len++] = savestring(list_optarg);
+      break;
+    case 'K':
+      conf->drop_globs = xrealloc(conf->drop_globs,
+                                  (conf->drop_globs_len + 1) * sizeof(char *));
+      conf->drop_globs[conf->drop_globs_len++] = savestring(list_optarg);
+      break;
+    case 'l':
+      conf->list_keys = xrealloc(conf->list_keys,
+                                 (conf->list_keys_len + 1) * sizeof(char *));
+      conf->list_keys[conf->list_keys_len++] = savestring(list_optarg);
+      break;
+    case 'L':
+      conf->lowercase = true;
+      break;
+    case 'M':
+      conf->mangle = true;
+      break;
+    case 'm':
+      conf->multiline = true;
+      break;
+    case 'n':
+      conf->check = true;
+      break;
+    case 'r':
+      conf->collect = true;
+      break;
+    case 'R':
+      conf->resolve = true;
+      break;
+    case 'O':
+      overlay = true;
+      break;
+    case 'o':
+      conf->order = true;
+      break;
+    case 'p':
+      prov_var_name = list_optarg;
+      break;
+    case 'P':
+      conf->export_prefix = list_optarg;
+      break;
+    case 's':
+      conf->flat_sep = list_optarg;
+      break;
+    case 'S':
+      schema_path = list_optarg;
+      break;
+    case 't':
+      transaction = true;
+      break;
+    case 'T':
+      if (!add_type_spec(conf, list_optarg)) {
+        return EXECUTION_FAILURE;
+      }
+      break;
     case 'u':
       code = legal_number(list_optarg, &intval);
       if (code == 0 || intval < 0 || intval != (int)intval) {
@@ -148,6 +3425,9 @@ int ini_builtin(WORD_LIST *list) {
         return EXECUTION_FAILURE;
       }
       break;
+    case 'x':
+      conf->export = true;
+      break;
     case GETOPT_HELP:
       builtin_help();
       return EX_USAGE;
@@ -156,48 +3436,275 @@ int ini_builtin(WORD_LIST *list) {
       return EX_USAGE;
     }
   }
-  if (!toc_var_name) {
+  if (conf->job && (job_id || conf->check || conf->paths_len || fd != 0)) {
+    builtin_error("the input of ini_wait is the job's");
+    return EX_USAGE;
+  }
+  if (job_id) {
+    if (conf->toc_var_name || callback_name || conf->export || conf->check) {
+      builtin_error("-A only reads the input, ini_wait makes the arrays");
+      return EX_USAGE;
+    }
+    return start_job(conf, job_id, fd);
+  }
+  if (conf->check) {
+    if (variable_context && !global_vars) {
+      conf->local_vars = true;
+    }
+    if (errors_var_name) {
+      conf->errors_var = ini_make_array(errors_var_name, conf->local_vars);
+      if (!conf->errors_var) {
+        builtin_error("Could not make %s", errors_var_name);
+        return EXECUTION_FAILURE;
+      }
+    }
+    return check_files(conf);
+  }
+  if (!conf->toc_var_name && !callback_name && !conf->export) {
     builtin_usage();
     return EX_USAGE;
   }
-  FILE *file = fdopen(fd, "r");
-  if (!file) {
-    builtin_error("%d: unable to open file descriptor: %s", fd,
-                  strerror(errno));
-    return EXECUTION_FAILURE;
+  if (callback_name && (conf->export || conf->env_override)) {
+    builtin_error("-x and -E cannot be used with -C");
+    return EX_USAGE;
+  }
+  if (transaction && (callback_name || conf->export)) {
+    builtin_error("-t cannot be used with -C or -x");
+    return EX_USAGE;
+  }
+  if (prov_var_name && !overlay) {
+    builtin_error("-p needs -O");
+    return EX_USAGE;
+  }
+  /* References and parents may be anywhere, so they need the whole store */
+  if (overlay || conf->resolve || conf->inherit) {
+    /* The store keeps one value per key */
+    if (conf->collect) {
+      builtin_error("-r cannot be used with -O, -R or -i");
+      return EX_USAGE;
+    }
+    conf->store = xmalloc(sizeof(entry_store));
+    memset(conf->store, 0, sizeof(entry_store));
+  }
+  if (schema_path && !errors_var_name && !conf->toc_var_name) {
+    builtin_error("-S needs -e ERRORS when there is no TOC");
+    return EX_USAGE;
+  }
+  if (callback_name) {
+    conf->callback = find_function(callback_name);
+    if (!conf->callback) {
+      builtin_error("%s: function not found", callback_name);
+      return EXECUTION_FAILURE;
+    }
   }
-  ini_conf conf = {0};
-  conf.toc_var_name = toc_var_name;
   if (variable_context && !global_vars) {
-    conf.local_vars = true;
+    conf->local_vars = true;
   } else {
-    conf.local_vars = false;
+    conf->local_vars = false;
   }
-  SHELL_VAR *toc_var = NULL;
-  if (conf.local_vars) {
-    int vflags = 0;
-    toc_var = make_local_assoc_variable(toc_var_name, vflags);
-  } else {
-    toc_var = make_new_assoc_variable(toc_var_name);
+  if (transaction) {
+    conf->real_toc_name = conf->toc_var_name;
+    conf->toc_var_name = join_name("__ini_shadow", "_", conf->real_toc_name);
+    conf->shadows = hash_create(64);
   }
-  if (!toc_var) {
-    builtin_error("Could not make %s", toc_var_name);
+  if (conf->toc_var_name && !conf->callback && !make_toc(conf)) {
     return EXECUTION_FAILURE;
   }
-  if (ini_parse_file(file, handler, &conf) < 0) {
-    builtin_error("Unable to read from fd: %d", fd);
+  if (prov_var_name) {
+    conf->prov_var = make_report(conf, prov_var_name);
+    if (!conf->prov_var) {
+      builtin_error("Could not make %s", prov_var_name);
+      return EXECUTION_FAILURE;
+    }
+  }
+  if (hash_var_name) {
+    conf->hash_var = make_report(conf, hash_var_name);
+    if (!conf->hash_var) {
+      builtin_error("Could not make %s", hash_var_name);
+      return EXECUTION_FAILURE;
+    }
+    xxh_init(&conf->input_hash);
+  }
+  if (schema_path) {
+    conf->schema = load_schema(schema_path);
+    if (!conf->schema) {
+      return EXECUTION_FAILURE;
+    }
+    conf->schema_seen = xmalloc(conf->schema->len + 1);
+    memset(conf->schema_seen, 0, conf->schema->len + 1);
+    /* The default errors array outlives a failed `-t` parse */
+    char *toc_var_name =
+        conf->real_toc_name ? conf->real_toc_name : conf->toc_var_name;
+    char *name = errors_var_name ? savestring(errors_var_name)
+                                 : join_name(toc_var_name, "__", "errors");
+    conf->errors_var = ini_make_array(name, conf->local_vars);
+    if (!conf->errors_var) {
+      builtin_error("Could not make %s", name);
+      free(name);
+      return EXECUTION_FAILURE;
+    }
+    if (!errors_var_name) {
+      register_var(toc_var_name, conf->errors_var);
+    }
+    free(name);
+  }
+  int ret = conf->job ? replay_job(conf, conf->job) : parse_input(conf, fd);
+  if (ret == 0 && conf->store && !replay_store(conf)) {
+    return conf->callback ? conf->callback_status : EXECUTION_FAILURE;
+  }
+  if (conf->callback) {
+    if (ret == 0) {
+      run_callback(conf);
+    }
+    if (conf->callback_status != EXECUTION_SUCCESS) {
+      return conf->callback_status;
+    }
+  }
+  if (ret < 0) {
     return EXECUTION_FAILURE;
   }
+  /* The handler reports its own errors, inih only reports the line of a
+   * syntax error */
+  if (ret > 0) {
+    if (!conf->handler_failed) {
+      builtin_error("Malformed ini, syntax error on line %d%s%s", ret,
+                    conf->path ? " of " : "", conf->path ? conf->path : "");
+    }
+    return EXECUTION_FAILURE;
+  }
+  if (conf->schema) {
+    check_required(conf);
+    if (conf->error_count) {
+      builtin_error("%s: %jd schema violations, see %s", schema_path,
+                    conf->error_count, conf->errors_var->name);
+      return EXECUTION_FAILURE;
+    }
+  }
+  if (conf->hash_var) {
+    bind_hash(conf, "input", xxh_digest(&conf->input_hash));
+    bind_hash(conf, "content", conf->content_hash);
+  }
   return EXECUTION_SUCCESS;
 }
 
+/* Returns the name of the array a shadow array replaces */
+static char *shadowed_name(ini_conf *conf, BUCKET_CONTENTS *item) {
+  if (item->data) {
+    return savestring(item->data);
+  }
+  return join_name(conf->real_toc_name, "",
+                   item->key + strlen(conf->toc_var_name));
+}
+
+/* Ends a `-t` parse. If it succeeded the shadow arrays replace the arrays
+ * they shadow, otherwise they are only removed. Returns the builtin's status */
+static int finish_shadows(ini_conf *conf, int ret) {
+  HASH_TABLE *shadows = conf->shadows;
+  /* Nothing is replaced unless everything can be */
+  for (int i = 0; ret == EXECUTION_SUCCESS && i < shadows->nbuckets; i++) {
+    BUCKET_CONTENTS *item;
+    for (item = hash_items(i, shadows); item; item = item->next) {
+      char *real_name = shadowed_name(conf, item);
+      SHELL_VAR *real = find_variable(real_name);
+      if (real && (readonly_p(real) || noassign_p(real))) {
+        sh_readonly(real_name);
+        ret = EXECUTION_FAILURE;
+      }
+      free(real_name);
+    }
+  }
+  for (int i = 0; i < shadows->nbuckets; i++) {
+    BUCKET_CONTENTS *item;
+    for (item = hash_items(i, shadows); item; item = item->next) {
+      SHELL_VAR *shadow = find_variable(item->key);
+      if (ret == EXECUTION_SUCCESS && shadow) {
+        char *real_name = shadowed_name(conf, item);
+        /* The cells are swapped, the old values then go with the shadow */
+        SHELL_VAR *real;
+        if (assoc_p(shadow)) {
+          real = ini_make_assoc(real_name, conf->local_vars, false);
+          if (real) {
+            HASH_TABLE *table = assoc_cell(real);
+            var_setassoc(real, assoc_cell(shadow));
+            var_setassoc(shadow, table);
+            if (integer_p(shadow)) {
+              VSETATTR(real, att_integer);
+            }
+          }
+        } else {
+          real = ini_make_array(real_name, conf->local_vars);
+          if (real) {
+            ARRAY *array = array_cell(real);
+            var_setarray(real, array_cell(shadow));
+            var_setarray(shadow, array);
+          }
+        }
+        /* The `-p` and `-H` arrays are not named after the TOC */
+        if (real && !item->data) {
+          register_var(conf->real_toc_name, real);
+        } else if (!real) {
+          ret = EXECUTION_FAILURE;
+        }
+        free(real_name);
+      }
+      unbind_variable(item->key);
+    }
+  }
+  return ret;
+}
+
+/* Runs `ini`, or `ini_wait` binding the records of `job` */
+static int run_conf(WORD_LIST *list, ini_job *job) {
+  ini_conf conf = {0};
+  conf.job = job;
+  int ret = run_ini(list, &conf);
+  if (conf.shadows) {
+    ret = finish_shadows(&conf, ret);
+  }
+  free_conf(&conf);
+  return ret;
+}
+
+int ini_builtin(WORD_LIST *list) { return run_conf(list, NULL); }
+
+int ini_wait_builtin(WORD_LIST *list) {
+  if (!list || *list->word->word == '-') {
+    builtin_usage();
+    return EX_USAGE;
+  }
+  ini_job *job = wait_job(list->word->word);
+  if (!job) {
+    return EXECUTION_FAILURE;
+  }
+  int ret = run_conf(list->next, job);
+  free_job(job);
+  return ret;
+}
+
 /* Provides Bash with information about the builtin */
 struct builtin ini_struct = {
     .name = "ini",            /* Builtin name */
     .function = ini_builtin,  /* Function implementing the builtin */
     .flags = BUILTIN_ENABLED, /* Initial flags for builtin */
     .long_doc = ini_doc,      /* Array of long documentation strings. */
-    .short_doc =
-        "ini -a TOC [-u FD] [-g]", /* Usage synopsis; becomes short_doc */
+    /* Usage synopsis; becomes short_doc */
+    .short_doc = "ini -a TOC [-u FD | -f FILE | -D DIR] [-g] [-o] "
+                 "[-F [-s SEP]] [-I] [-m] [-O [-p PROV]] [-R] [-i] "
+                 "[-l SEC.KEY] [-r] [-d DELIM] [-x] [-P PREFIX] [-E] "
+                 "[-H HASH] [-t] [-L] [-k GLOB] [-K GLOB] [-M] "
+                 "[-T SEC.KEY=int] [-S SCHEMA [-e ERRORS]] "
+                 "[-C FUNC [-c QUANTUM]] "
+                 "| ini -A JOBID [-u FD | -f FILE | -D DIR] "
+                 "| ini -n [-e ERRORS] -f FILE | -D DIR",
+    .handle = 0 /* Reserved for internal use */
+};
+
+/* Provides Bash with information about the builtin */
+struct builtin ini_wait_struct = {
+    .name = "ini_wait",            /* Builtin name */
+    .function = ini_wait_builtin,  /* Function implementing the builtin */
+    .flags = BUILTIN_ENABLED,      /* Initial flags for builtin */
+    .long_doc = ini_wait_doc,      /* Array of long documentation strings. */
+    .short_doc = "ini_wait JOBID -a TOC [ini options]", /* Usage synopsis */
     .handle = 0                    /* Reserved for internal use */
 };
@@ -0,0 +1,31 @@
+/* Functions shared by the builtins of ini.so, included after shell.h */
+#ifndef INI_BUILTINS_H
+#define INI_BUILTINS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+/* Returns an empty associative array named `name`, local to the current
+ * function or global, see ini.c */
+SHELL_VAR *ini_make_assoc(char *name, bool local_vars, bool flush);
+
+/* Removes the TOC `toc_var_name` from the registry of the arrays made by
+ * `ini` and returns the names of its arrays, each mapped to the variable
+ * context it was made in, or NULL if none were made */
+HASH_TABLE *ini_registry_take(const char *toc_var_name);
+
+/* Returns the escape of the character `c` of `value` when it is written
+ * quoted, or NULL, see ini_dump.c */
+const char *ini_value_escape(const char *value, const char *c);
+
+/* Returns true when `value` must be written quoted to be read back as is */
+bool ini_value_quoted(const char *value);
+
+/* Returns `value` quoted and escaped when it needs to be, to be freed */
+char *ini_quote_value(const char *value);
+
+/* Writes all of `bufs` to `fd` with writev(2), false on a write error */
+bool ini_writev(int fd, const struct iovec *bufs, size_t len);
+
+#endif
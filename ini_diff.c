@@ -0,0 +1,168 @@
+#include "builtins.h"
+#include "shell.h"
+#include "bashgetopt.h"
+#include "common.h"
+#include "ini_builtins.h"
+#include <stdbool.h>
+
+char *ini_diff_doc[] = {
+    "Compares two configs read by `ini`.",
+    "",
+    "Compares the sections listed in the `OLD_TOC` and `NEW_TOC` associative",
+    "arrays and the keys and values of their `<TOC>_<INI_SECTION_NAME>`",
+    "arrays, and fills the associative array `RESULT` with what changed.",
+    "Each key of `RESULT` is a `SECTION.KEY` whose value is `added`,",
+    "`removed` or `changed`. A section only in one of the configs is also",
+    "listed under its own name, as `added` or `removed`, so that sections",
+    "without keys are not missed. Unchanged keys are left out, so an empty",
+    "`RESULT` means the configs are the same.",
+    "",
+    "A TOC key without a section array, as in the TOC made by `ini -F`, is",
+    "compared by its value in the TOC, so flat configs are compared key by",
+    "key under their `SECTION<SEP>KEY` names.",
+    "",
+    "Every key is looked up once in the other config's hash table, so the",
+    "comparison takes time linear in the size of the configs.",
+    "",
+    "Inside a function `RESULT` is made local, unless `-g` is given.",
+    NULL};
+
+/* Returns `<prefix><sep><suffix>`, freshly allocated */
+static char *diff_name(const char *prefix, char sep, const char *suffix) {
+  size_t len = strlen(prefix);
+  char *name = xmalloc(len + strlen(suffix) + 2);
+  memcpy(name, prefix, len);
+  name[len] = sep;
+  strcpy(name + len + 1, suffix);
+  return name;
+}
+
+/* Returns the keys and values of `<toc_var_name>_<section>`, or NULL when
+ * the section is not in the TOC */
+static HASH_TABLE *diff_section(const char *toc_var_name, HASH_TABLE *toc,
+                                const char *section) {
+  if (!hash_search(section, toc, 0)) {
+    return NULL;
+  }
+  char *name = diff_name(toc_var_name, '_', section);
+  SHELL_VAR *var = find_variable(name);
+  free(name);
+  return var && assoc_p(var) ? assoc_cell(var) : NULL;
+}
+
+static void diff_add(SHELL_VAR *result, const char *section, const char *key,
+                     char *change) {
+  char *name = key ? diff_name(section, '.', key) : savestring(section);
+  bind_assoc_variable(result, result->name, name, change, 0);
+}
+
+/* Adds every key of `table` not in `other` as `change`, and if `changed` is
+ * set every key in both with a different value as changed */
+static void diff_table(SHELL_VAR *result, const char *section,
+                       HASH_TABLE *table, HASH_TABLE *other, char *change,
+                       bool changed) {
+  if (!table) {
+    return;
+  }
+  for (int i = 0; i < table->nbuckets; i++) {
+    BUCKET_CONTENTS *item;
+    for (item = hash_items(i, table); item; item = item->next) {
+      BUCKET_CONTENTS *match = other ? hash_search(item->key, other, 0) : NULL;
+      if (!match) {
+        diff_add(result, section, item->key, change);
+      } else if (changed && strcmp(item->data, match->data) != 0) {
+        diff_add(result, section, item->key, "changed");
+      }
+    }
+  }
+}
+
+/* Adds the sections of the `toc` TOC, and their keys, missing from or
+ * changed in the `other` TOC. TOC keys with no section array in either
+ * config, the keys of a flat TOC, are compared as values */
+static void diff_tocs(SHELL_VAR *result, SHELL_VAR *toc, SHELL_VAR *other,
+                      char *change, bool changed) {
+  HASH_TABLE *sections = assoc_cell(toc);
+  for (int i = 0; i < sections->nbuckets; i++) {
+    BUCKET_CONTENTS *item;
+    for (item = hash_items(i, sections); item; item = item->next) {
+      HASH_TABLE *table = diff_section(toc->name, sections, item->key);
+      HASH_TABLE *other_table =
+          diff_section(other->name, assoc_cell(other), item->key);
+      BUCKET_CONTENTS *match = hash_search(item->key, assoc_cell(other), 0);
+      if (!match) {
+        diff_add(result, item->key, NULL, change);
+      } else if (changed && !table && !other_table &&
+                 strcmp(item->data, match->data) != 0) {
+        diff_add(result, item->key, NULL, "changed");
+      }
+      diff_table(result, item->key, table, other_table, change, changed);
+    }
+  }
+}
+
+/* Returns the TOC named `name`, or NULL after reporting the error */
+static SHELL_VAR *diff_toc(char *name) {
+  SHELL_VAR *var = find_variable(name);
+  if (!var || !assoc_p(var)) {
+    builtin_error("%s: not an associative array", name);
+    return NULL;
+  }
+  return var;
+}
+
+int ini_diff_builtin(WORD_LIST *list) {
+  int opt;
+  bool global_vars = false;
+  reset_internal_getopt();
+  while ((opt = internal_getopt(list, "g")) != -1) {
+    switch (opt) {
+    case 'g':
+      global_vars = true;
+      break;
+    case GETOPT_HELP:
+      builtin_help();
+      return EX_USAGE;
+    default:
+      builtin_usage();
+      return EX_USAGE;
+    }
+  }
+  list = loptend;
+  if (!list || !list->next || !list->next->next || list->next->next->next) {
+    builtin_usage();
+    return EX_USAGE;
+  }
+  char *result_name = list->next->next->word->word;
+  if (!legal_identifier(result_name)) {
+    sh_invalidid(result_name);
+    return EXECUTION_FAILURE;
+  }
+  SHELL_VAR *old_toc = diff_toc(list->word->word);
+  SHELL_VAR *new_toc = diff_toc(list->next->word->word);
+  if (!old_toc || !new_toc) {
+    return EXECUTION_FAILURE;
+  }
+  SHELL_VAR *result = find_variable(result_name);
+  if (result && (result == old_toc || result == new_toc)) {
+    builtin_error("%s: cannot be one of the TOCs", result_name);
+    return EXECUTION_FAILURE;
+  }
+  result = ini_make_assoc(result_name, variable_context && !global_vars, true);
+  if (!result) {
+    return EXECUTION_FAILURE;
+  }
+  diff_tocs(result, new_toc, old_toc, "added", true);
+  diff_tocs(result, old_toc, new_toc, "removed", false);
+  return EXECUTION_SUCCESS;
+}
+
+/* Provides Bash with information about the builtin */
+struct builtin ini_diff_struct = {
+    .name = "ini_diff",             /* Builtin name */
+    .function = ini_diff_builtin,   /* Function implementing the builtin */
+    .flags = BUILTIN_ENABLED,       /* Initial flags for builtin */
+    .long_doc = ini_diff_doc,       /* Array of long documentation strings. */
+    .short_doc = "ini_diff [-g] OLD_TOC NEW_TOC RESULT", /* Usage synopsis */
+    .handle = 0                     /* Reserved for internal use */
+};
@@ -0,0 +1,377 @@
+#include "builtins.h"
+#include "shell.h"
+#include "bashgetopt.h"
+#include "common.h"
+#include "ini_builtins.h"
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <sys/uio.h>
+
+char *ini_dump_doc[] = {
+    "Writes the arrays made by `ini` back out as an INI config.",
+    "",
+    "Writes the sections listed in the `TOC` associative array, and the keys",
+    "and values of each `<TOC>_<INI_SECTION_NAME>` array, as an INI config",
+    "to stdout, to the `FD` file descriptor with `-u FD` or to the file",
+    "`PATH` with `-f PATH`. The output is formatted in memory and written",
+    "with as few writev(2) calls as possible.",
+    "",
+    "Sections and keys are written in hash order unless `-o` is given, then",
+    "the `<TOC>__order` and `<TOC>_<INI_SECTION_NAME>__keys` arrays made by",
+    "`ini -o` give the order, followed by anything added since in hash order.",
+    "Values are written so that `ini -m` reads them back as they are: one",
+    "with leading or trailing whitespace, a leading quote, a newline, tab,",
+    "carriage return or backslash, or a `;` that would start a comment is",
+    "quoted, with those characters and quotes escaped. A TOC made by",
+    "`ini -M` holds the section names as written in the config, those are",
+    "the names written back.",
+    NULL};
+
+/* The most blocks one writev(2) takes, POSIX only promises 16 */
+#ifndef IOV_MAX
+#define IOV_MAX 16
+#endif
+
+/* The size of the blocks the output is formatted into */
+#define DUMP_BLOCK_SIZE (64 * 1024)
+
+/* The formatted output, a list of blocks for writev */
+typedef struct {
+  struct iovec *iov;
+  size_t len;
+  size_t size;
+} dump_buf;
+
+/* Appends bytes to the output, starting a new block when one is full so
+ * that nothing is ever copied twice */
+static void dump_add(dump_buf *buf, const char *bytes, size_t n) {
+  while (n) {
+    if (!buf->len || buf->iov[buf->len - 1].iov_len == DUMP_BLOCK_SIZE) {
+      if (buf->len == buf->size) {
+        buf->size = buf->size ? buf->size * 2 : 16;
+        buf->iov = xrealloc(buf->iov, buf->size * sizeof(struct iovec));
+      }
+      buf->iov[buf->len].iov_base = xmalloc(DUMP_BLOCK_SIZE);
+      buf->iov[buf->len++].iov_len = 0;
+    }
+    struct iovec *block = &buf->iov[buf->len - 1];
+    size_t take = DUMP_BLOCK_SIZE - block->iov_len;
+    if (take > n) {
+      take = n;
+    }
+    memcpy((char *)block->iov_base + block->iov_len, bytes, take);
+    block->iov_len += take;
+    bytes += take;
+    n -= take;
+  }
+}
+
+static void dump_str(dump_buf *buf, const char *str) {
+  dump_add(buf, str, strlen(str));
+}
+
+/* Returns the escape of a character of a quoted value, or NULL. A `;`
+ * after whitespace would start an inline comment, as would one at the start
+ * of the value, which follows the ` = ` */
+const char *ini_value_escape(const char *value, const char *c) {
+  switch (*c) {
+  case '\n':
+    return "\\n";
+  case '\r':
+    return "\\r";
+  case '\t':
+    return "\\t";
+  case '\\':
+    return "\\\\";
+  case '"':
+    return "\\\"";
+  case ';':
+    return c == value || isspace((unsigned char)c[-1]) ? "\\;" : NULL;
+  default:
+    return NULL;
+  }
+}
+
+/* Returns false when inih and `ini -m` read the value back as it is */
+bool ini_value_quoted(const char *value) {
+  size_t len = strlen(value);
+  if (!len) {
+    return false;
+  }
+  if (isspace((unsigned char)value[0]) ||
+      isspace((unsigned char)value[len - 1]) || *value == '"' ||
+      *value == '\'') {
+    return true;
+  }
+  for (const char *c = value; *c; c++) {
+    if (*c != '"' && ini_value_escape(value, c)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Returns the value as `ini_dump` writes it, for `ini_set` */
+char *ini_quote_value(const char *value) {
+  if (!ini_value_quoted(value)) {
+    return savestring(value);
+  }
+  size_t len = 2;
+  for (const char *c = value; *c; c++) {
+    len += ini_value_escape(value, c) ? 2 : 1;
+  }
+  char *text = xmalloc(len + 1);
+  char *out = text;
+  *out++ = '"';
+  for (const char *c = value; *c; c++) {
+    const char *escape = ini_value_escape(value, c);
+    if (escape) {
+      out = stpcpy(out, escape);
+    } else {
+      *out++ = *c;
+    }
+  }
+  *out++ = '"';
+  *out = '\0';
+  return text;
+}
+
+/* Appends `name = value`, the value quoted and escaped when it needs to be,
+ * in the form `ini -m` decodes */
+static void dump_entry(dump_buf *buf, const char *name, const char *value) {
+  dump_str(buf, name);
+  dump_add(buf, " = ", 3);
+  if (!ini_value_quoted(value)) {
+    dump_str(buf, value);
+    dump_add(buf, "\n", 1);
+    return;
+  }
+  dump_add(buf, "\"", 1);
+  const char *run = value;
+  for (const char *c = value; *c; c++) {
+    const char *escape = ini_value_escape(value, c);
+    if (escape) {
+      dump_add(buf, run, c - run);
+      dump_add(buf, escape, 2);
+      run = c + 1;
+    }
+  }
+  dump_str(buf, run);
+  dump_add(buf, "\"\n", 2);
+}
+
+/* Writes every buffer, IOV_MAX at a time, carrying on after short writes */
+bool ini_writev(int fd, const struct iovec *bufs, size_t len) {
+  struct iovec *iov = xmalloc((len + 1) * sizeof(struct iovec));
+  memcpy(iov, bufs, len * sizeof(struct iovec));
+  struct iovec *next = iov;
+  size_t left = len;
+  bool ok = true;
+  while (left) {
+    ssize_t n = writev(fd, next, left > IOV_MAX ? IOV_MAX : left);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      ok = false;
+      break;
+    }
+    while (left && (size_t)n >= next->iov_len) {
+      n -= next->iov_len;
+      next++;
+      left--;
+    }
+    if (left) {
+      next->iov_base = (char *)next->iov_base + n;
+      next->iov_len -= n;
+    }
+  }
+  free(iov);
+  return ok;
+}
+
+static void dump_free(dump_buf *buf) {
+  for (size_t i = 0; i < buf->len; i++) {
+    free(buf->iov[i].iov_base);
+  }
+  free(buf->iov);
+}
+
+/* Returns `<prefix><suffix>`, freshly allocated */
+static char *dump_name(const char *prefix, const char *suffix) {
+  char *name = xmalloc(strlen(prefix) + strlen(suffix) + 1);
+  strcpy(name, prefix);
+  strcat(name, suffix);
+  return name;
+}
+
+/* Finds the indexed array `<prefix><suffix>` made by `ini -o` */
+static ARRAY *dump_order(const char *prefix, const char *suffix) {
+  char *name = dump_name(prefix, suffix);
+  SHELL_VAR *var = find_variable(name);
+  free(name);
+  return var && array_p(var) ? array_cell(var) : NULL;
+}
+
+/* Appends every key of `table`, first those listed in `order`, then the
+ * others in hash order. If `toc_var_name` is given the table is the TOC and
+ * its keys are the sections to append */
+static bool dump_table(dump_buf *buf, const char *toc_var_name,
+                       HASH_TABLE *table, ARRAY *order);
+
+/* Appends a section, `[section]` then its keys. `section` is the TOC key
+ * naming the section array, `toc_value` its TOC value, which is the name in
+ * the config unless it is the plain `true` marker */
+static bool dump_section(dump_buf *buf, const char *toc_var_name,
+                         const char *section, const char *toc_value,
+                         bool ordered) {
+  char *sec_var_name = dump_name(toc_var_name, "_");
+  char *full_name = dump_name(sec_var_name, section);
+  free(sec_var_name);
+  SHELL_VAR *sec_var = find_variable(full_name);
+  if (!sec_var || !assoc_p(sec_var)) {
+    builtin_error("%s: not an associative array", full_name);
+    free(full_name);
+    return false;
+  }
+  ARRAY *order = ordered ? dump_order(full_name, "__keys") : NULL;
+  free(full_name);
+  if (buf->len) {
+    dump_add(buf, "\n", 1);
+  }
+  dump_add(buf, "[", 1);
+  dump_str(buf, strcmp(toc_value, "true") != 0 ? toc_value : section);
+  dump_add(buf, "]\n", 2);
+  return dump_table(buf, NULL, assoc_cell(sec_var), order);
+}
+
+static bool dump_table(dump_buf *buf, const char *toc_var_name,
+                       HASH_TABLE *table, ARRAY *order) {
+  HASH_TABLE *done = order ? hash_create(64) : NULL;
+  bool ok = true;
+  if (order) {
+    ARRAY_ELEMENT *ae;
+    for (ae = element_forw(order->head); ok && ae != order->head;
+         ae = element_forw(ae)) {
+      char *name = element_value(ae);
+      char *value = assoc_reference(table, name);
+      if (!value || hash_search(name, done, 0)) {
+        continue;
+      }
+      hash_insert(savestring(name), done, HASH_NOSRCH)->data = NULL;
+      if (toc_var_name) {
+        ok = dump_section(buf, toc_var_name, name, value, true);
+      } else {
+        dump_entry(buf, name, value);
+      }
+    }
+  }
+  for (int i = 0; ok && i < table->nbuckets; i++) {
+    BUCKET_CONTENTS *item;
+    for (item = hash_items(i, table); ok && item; item = item->next) {
+      if (done && hash_search(item->key, done, 0)) {
+        continue;
+      }
+      if (toc_var_name) {
+        ok = dump_section(buf, toc_var_name, item->key, item->data,
+                          order != NULL);
+      } else {
+        dump_entry(buf, item->key, item->data);
+      }
+    }
+  }
+  if (done) {
+    hash_flush(done, NULL);
+    hash_dispose(done);
+  }
+  return ok;
+}
+
+int ini_dump_builtin(WORD_LIST *list) {
+  intmax_t intval;
+  int opt, code;
+  int fd = 1;
+  char *toc_var_name = NULL;
+  char *path = NULL;
+  bool ordered = false;
+  reset_internal_getopt();
+  while ((opt = internal_getopt(list, "a:f:ou:")) != -1) {
+    switch (opt) {
+    case 'a':
+      toc_var_name = list_optarg;
+      break;
+    case 'f':
+      path = list_optarg;
+      break;
+    case 'o':
+      ordered = true;
+      break;
+    case 'u':
+      code = legal_number(list_optarg, &intval);
+      if (code == 0 || intval < 0 || intval != (int)intval) {
+        builtin_error("%s: invalid file descriptor specification", list_optarg);
+        return EXECUTION_FAILURE;
+      }
+      fd = (int)intval;
+      if (sh_validfd(fd) == 0) {
+        builtin_error("%d: invalid file descriptor: %s", fd, strerror(errno));
+        return EXECUTION_FAILURE;
+      }
+      break;
+    case GETOPT_HELP:
+      builtin_help();
+      return EX_USAGE;
+    default:
+      builtin_usage();
+      return EX_USAGE;
+    }
+  }
+  if (!toc_var_name) {
+    builtin_usage();
+    return EX_USAGE;
+  }
+  SHELL_VAR *toc_var = find_variable(toc_var_name);
+  if (!toc_var || !assoc_p(toc_var)) {
+    builtin_error("%s: not an associative array", toc_var_name);
+    return EXECUTION_FAILURE;
+  }
+  dump_buf buf = {0};
+  ARRAY *order = ordered ? dump_order(toc_var_name, "__order") : NULL;
+  if (!dump_table(&buf, toc_var_name, assoc_cell(toc_var), order)) {
+    dump_free(&buf);
+    return EXECUTION_FAILURE;
+  }
+  if (path) {
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+      builtin_error("%s: %s", path, strerror(errno));
+      dump_free(&buf);
+      return EXECUTION_FAILURE;
+    }
+  }
+  bool ok = ini_writev(fd, buf.iov, buf.len);
+  if (!ok && path) {
+    builtin_error("%s: write error: %s", path, strerror(errno));
+  } else if (!ok) {
+    builtin_error("%d: write error: %s", fd, strerror(errno));
+  }
+  if (path && close(fd) != 0 && ok) {
+    builtin_error("%s: %s", path, strerror(errno));
+    ok = false;
+  }
+  dump_free(&buf);
+  return ok ? EXECUTION_SUCCESS : EXECUTION_FAILURE;
+}
+
+/* Provides Bash with information about the builtin */
+struct builtin ini_dump_struct = {
+    .name = "ini_dump",             /* Builtin name */
+    .function = ini_dump_builtin,   /* Function implementing the builtin */
+    .flags = BUILTIN_ENABLED,       /* Initial flags for builtin */
+    .long_doc = ini_dump_doc,       /* Array of long documentation strings. */
+    .short_doc = "ini_dump -a TOC [-o] [-u FD | -f PATH]", /* Usage synopsis */
+    .handle = 0                     /* Reserved for internal use */
+};
@@ -0,0 +1,516 @@
+#include "builtins.h"
+#include "shell.h"
+#include "bashgetopt.h"
+#include "common.h"
+#include "ini_builtins.h"
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+char *ini_set_doc[] = {
+    "Sets keys in an INI config file in place.",
+    "",
+    "Sets each `KEY` of `SECTION` to `VALUE` in the INI config `PATH`. Only",
+    "the value is replaced, the spacing, comments and order of everything",
+    "else in the file are kept. A key given several times in a section has",
+    "every occurrence set, so that the value read back is `VALUE` whichever",
+    "occurrence wins. Keys not yet in the config are added after the last",
+    "key of their section, sections not yet in the config are added at the",
+    "end. Values are quoted and escaped as `ini_dump` writes them, so that",
+    "`ini -m` reads them back as they were given.",
+    "",
+    "The config is mapped with mmap(2) and all the edits are applied in a",
+    "single pass into a new file beside it, which is synced and renamed over",
+    "the config, so readers see either the old or the new config, never a",
+    "partly written one. Concurrent `ini_set` calls on the same config are",
+    "serialized with flock(2). `PATH` is created when it does not exist.",
+    NULL};
+
+/* One requested edit */
+typedef struct {
+  char *section;
+  char *name;
+  char *value;
+  bool found;
+} set_edit;
+
+/* Where keys are added to a section, after its last key */
+typedef struct {
+  size_t insert_at;
+  bool seen;
+} set_section;
+
+/* Replaces the bytes from `start` to `end` of the config with `text` */
+typedef struct {
+  size_t start;
+  size_t end;
+  size_t seq;
+  char *text;
+} set_span;
+
+typedef struct {
+  HASH_TABLE *edits;
+  HASH_TABLE *sections;
+  set_edit *list;
+  size_t len;
+  set_span *spans;
+  size_t spans_len;
+  size_t spans_size;
+  const char *eol;
+  char *scratch;
+  size_t scratch_size;
+} set_state;
+
+static void set_span_add(set_state *state, size_t start, size_t end,
+                         char *text) {
+  if (state->spans_len == state->spans_size) {
+    state->spans_size = state->spans_size ? state->spans_size * 2 : 16;
+    state->spans =
+        xrealloc(state->spans, state->spans_size * sizeof(set_span));
+  }
+  set_span *span = &state->spans[state->spans_len];
+  span->start = start;
+  span->end = end;
+  span->seq = state->spans_len++;
+  span->text = text;
+}
+
+static int set_span_cmp(const void *a, const void *b) {
+  const set_span *x = a, *y = b;
+  if (x->start != y->start) {
+    return x->start < y->start ? -1 : 1;
+  }
+  return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/* Returns `<section>\n<name>`, the key of an edit, in the scratch buffer, or
+ * just the section name when `name` is NULL */
+static char *set_key(set_state *state, const char *section, size_t sec_len,
+                     const char *name, size_t name_len) {
+  size_t size = name ? sec_len + name_len + 2 : sec_len + 1;
+  if (size > state->scratch_size) {
+    state->scratch_size = size * 2;
+    state->scratch = xrealloc(state->scratch, state->scratch_size);
+  }
+  memcpy(state->scratch, section, sec_len);
+  if (name) {
+    state->scratch[sec_len] = '\n';
+    memcpy(state->scratch + sec_len + 1, name, name_len);
+  }
+  state->scratch[size - 1] = '\0';
+  return state->scratch;
+}
+
+/* Returns `name = value` and a line end */
+static char *set_entry(set_state *state, const set_edit *edit) {
+  char *value = ini_quote_value(edit->value);
+  char *text = xmalloc(strlen(edit->name) + strlen(value) +
+                       strlen(state->eol) + 4);
+  sprintf(text, "%s = %s%s", edit->name, value, state->eol);
+  free(value);
+  return text;
+}
+
+/* Like inih's find_chars_or_comment, returns the first of `chars` or the
+ * start of an inline comment, a `;` after whitespace */
+static const char *set_find(const char *s, const char *end,
+                            const char *chars) {
+  bool was_space = false;
+  for (; s < end; s++) {
+    if ((chars && strchr(chars, *s)) || (*s == ';' && was_space)) {
+      break;
+    }
+    was_space = isspace((unsigned char)*s);
+  }
+  return s;
+}
+
+static const char *set_rstrip(const char *start, const char *end) {
+  while (end > start && isspace((unsigned char)end[-1])) {
+    end--;
+  }
+  return end;
+}
+
+/* Scans the config line by line the way inih reads it, replacing the values
+ * of the edited keys and dropping their continuation lines, and records
+ * where missing keys go */
+static void set_scan(set_state *state, const char *map, size_t size) {
+  size_t pos = 0;
+  if (size >= 3 && memcmp(map, "\xEF\xBB\xBF", 3) == 0) {
+    pos = 3;
+  }
+  const char *section = NULL;
+  size_t sec_len = 0;
+  BUCKET_CONTENTS *item;
+  set_section *current = NULL;
+  bool prev_name = false;
+  bool drop = false;
+  while (pos < size) {
+    const char *line = map + pos;
+    const char *newline = memchr(line, '\n', size - pos);
+    const char *end = newline ? newline : map + size;
+    size_t next = newline ? (size_t)(newline - map) + 1 : size;
+    const char *start = line;
+    while (start < end && isspace((unsigned char)*start)) {
+      start++;
+    }
+    const char *stop = set_rstrip(start, end);
+    if (start == stop || *start == ';' || *start == '#' || *line == '!') {
+      /* Blank lines, comments and directives */
+    } else if (prev_name && start > line) {
+      if (drop) {
+        set_span_add(state, pos, next, NULL);
+      }
+      if (current) {
+        current->insert_at = next;
+      }
+    } else if (*start == '[') {
+      const char *close = set_find(start + 1, stop, "]");
+      prev_name = false;
+      if (close < stop && *close == ']') {
+        section = start + 1;
+        sec_len = close - section;
+        item = hash_search(set_key(state, section, sec_len, NULL, 0),
+                           state->sections, 0);
+        current = item ? item->data : NULL;
+        if (current) {
+          current->insert_at = next;
+          current->seen = true;
+        }
+      }
+    } else {
+      const char *delim = set_find(start, stop, "=:");
+      if (delim < stop && (*delim == '=' || *delim == ':')) {
+        const char *name_end = set_rstrip(start, delim);
+        const char *value = delim + 1;
+        while (value < stop && isspace((unsigned char)*value)) {
+          value++;
+        }
+        const char *value_end = set_rstrip(value, set_find(value, stop, NULL));
+        prev_name = true;
+        drop = false;
+        item = current ? hash_search(set_key(state, section, sec_len, start,
+                                          name_end - start),
+                                  state->edits, 0)
+                    : NULL;
+        if (item) {
+          set_edit *edit = item->data;
+          edit->found = true;
+          drop = true;
+          set_span_add(state, value - map, value_end - map,
+                       ini_quote_value(edit->value));
+        }
+        if (current) {
+          current->insert_at = next;
+        }
+      }
+    }
+    pos = next;
+  }
+}
+
+/* Adds the keys and sections the scan did not find */
+static void set_missing(set_state *state, const char *map, size_t size) {
+  bool newline = !size || map[size - 1] == '\n';
+  char *tail = NULL;
+  size_t tail_len = 0;
+  for (size_t i = 0; i < state->len; i++) {
+    set_edit *edit = &state->list[i];
+    if (edit->found) {
+      continue;
+    }
+    set_section *section =
+        hash_search(edit->section, state->sections, 0)->data;
+    if (section->seen) {
+      char *text = set_entry(state, edit);
+      if (section->insert_at == size && !newline) {
+        char *line = xmalloc(strlen(state->eol) + strlen(text) + 1);
+        strcpy(stpcpy(line, state->eol), text);
+        free(text);
+        text = line;
+        newline = true;
+      }
+      set_span_add(state, section->insert_at, section->insert_at, text);
+      continue;
+    }
+    /* The first missing key of a new section writes all of its keys */
+    section->seen = true;
+    size_t eol_len = strlen(state->eol);
+    for (size_t j = i; j < state->len; j++) {
+      set_edit *other = &state->list[j];
+      if (j > i && strcmp(other->section, edit->section) != 0) {
+        continue;
+      }
+      char *text = set_entry(state, other);
+      size_t text_len = strlen(text);
+      size_t header_len = j == i ? strlen(other->section) + 3 * eol_len + 2 : 0;
+      tail = xrealloc(tail, tail_len + header_len + text_len + 1);
+      if (j == i) {
+        if (!newline) {
+          tail_len = stpcpy(tail + tail_len, state->eol) - tail;
+        }
+        if (size || tail_len) {
+          tail_len = stpcpy(tail + tail_len, state->eol) - tail;
+        }
+        tail[tail_len++] = '[';
+        tail_len = stpcpy(tail + tail_len, other->section) - tail;
+        tail[tail_len++] = ']';
+        tail_len = stpcpy(tail + tail_len, state->eol) - tail;
+        newline = true;
+      }
+      tail_len = stpcpy(tail + tail_len, text) - tail;
+      free(text);
+      other->found = true;
+    }
+  }
+  if (tail) {
+    set_span_add(state, size, size, tail);
+  }
+}
+
+/* Writes the config with the edits applied to `fd` */
+static bool set_write(set_state *state, int fd, const char *map, size_t size) {
+  qsort(state->spans, state->spans_len, sizeof(set_span), set_span_cmp);
+  struct iovec *iov = xmalloc((2 * state->spans_len + 1) * sizeof(*iov));
+  size_t len = 0;
+  size_t pos = 0;
+  for (size_t i = 0; i < state->spans_len; i++) {
+    set_span *span = &state->spans[i];
+    if (span->start > pos) {
+      iov[len].iov_base = (char *)map + pos;
+      iov[len++].iov_len = span->start - pos;
+    }
+    if (span->text && *span->text) {
+      iov[len].iov_base = span->text;
+      iov[len++].iov_len = strlen(span->text);
+    }
+    pos = span->end;
+  }
+  if (size > pos) {
+    iov[len].iov_base = (char *)map + pos;
+    iov[len++].iov_len = size - pos;
+  }
+  bool ok = ini_writev(fd, iov, len);
+  free(iov);
+  return ok;
+}
+
+static void keep_data(void *data) { (void)data; }
+
+/* The edits table points into the list of edits */
+static void set_free(set_state *state) {
+  for (size_t i = 0; i < state->spans_len; i++) {
+    free(state->spans[i].text);
+  }
+  free(state->spans);
+  free(state->scratch);
+  free(state->list);
+  if (state->edits) {
+    hash_flush(state->edits, keep_data);
+    hash_dispose(state->edits);
+  }
+  if (state->sections) {
+    hash_flush(state->sections, NULL);
+    hash_dispose(state->sections);
+  }
+}
+
+/* Returns false when `str` could not be read back as a section or key name */
+static bool set_legal(const char *str, bool section) {
+  if (strchr(str, '\n') || strchr(str, '\r')) {
+    return false;
+  }
+  if (section) {
+    return *str && !strchr(str, ']');
+  }
+  return *str && !strpbrk(str, "=:") && !isspace((unsigned char)*str) &&
+         !isspace((unsigned char)str[strlen(str) - 1]) && *str != '[' &&
+         *str != ';' && *str != '#' && *str != '!';
+}
+
+/* Reads the requested edits, later edits of a key replacing earlier ones */
+static bool set_edits(set_state *state, WORD_LIST *list) {
+  size_t words = 0;
+  for (WORD_LIST *l = list; l; l = l->next) {
+    words++;
+  }
+  if (words == 0 || words % 3 != 0) {
+    builtin_usage();
+    return false;
+  }
+  state->list = xmalloc(words / 3 * sizeof(set_edit));
+  state->edits = hash_create(64);
+  state->sections = hash_create(16);
+  for (; list; list = list->next->next->next) {
+    char *section = list->word->word;
+    char *name = list->next->word->word;
+    if (!set_legal(section, true)) {
+      builtin_error("%s: invalid section name", section);
+      return false;
+    }
+    if (!set_legal(name, false)) {
+      builtin_error("%s: invalid key name", name);
+      return false;
+    }
+    char *key = set_key(state, section, strlen(section), name, strlen(name));
+    BUCKET_CONTENTS *item = hash_search(key, state->edits, 0);
+    if (item) {
+      ((set_edit *)item->data)->value = list->next->next->word->word;
+      continue;
+    }
+    set_edit *edit = &state->list[state->len];
+    edit->section = section;
+    edit->name = name;
+    edit->value = list->next->next->word->word;
+    state->len++;
+    edit->found = false;
+    hash_insert(savestring(key), state->edits, HASH_NOSRCH)->data = edit;
+    if (!hash_search(section, state->sections, 0)) {
+      set_section *sec = xmalloc(sizeof(set_section));
+      sec->insert_at = 0;
+      sec->seen = false;
+      hash_insert(savestring(section), state->sections, HASH_NOSRCH)->data =
+          sec;
+    }
+  }
+  return true;
+}
+
+/* Opens and locks `path`, reopening it when another editor renamed a new
+ * config over it while we waited for the lock */
+static int set_lock(const char *path, struct stat *st) {
+  for (;;) {
+    int fd = open(path, O_RDWR | O_CREAT, 0666);
+    if (fd < 0) {
+      return -1;
+    }
+    struct stat now;
+    if (flock(fd, LOCK_EX) != 0 || fstat(fd, st) != 0) {
+      int saved = errno;
+      close(fd);
+      errno = saved;
+      return -1;
+    }
+    if (stat(path, &now) == 0 && now.st_dev == st->st_dev &&
+        now.st_ino == st->st_ino) {
+      return fd;
+    }
+    close(fd);
+  }
+}
+
+/* Syncs the directory holding `path`, making the rename durable */
+static void set_sync_dir(const char *path) {
+  const char *slash = strrchr(path, '/');
+  char *dir = slash ? substring(path, 0, slash == path ? 1 : slash - path)
+                    : savestring(".");
+  int fd = open(dir, O_RDONLY);
+  if (fd >= 0) {
+    fsync(fd);
+    close(fd);
+  }
+  free(dir);
+}
+
+/* Writes the edited config to a temporary file and renames it over `path` */
+static bool set_file(set_state *state, const char *path) {
+  struct stat st;
+  int fd = set_lock(path, &st);
+  if (fd < 0) {
+    builtin_error("%s: %s", path, strerror(errno));
+    return false;
+  }
+  size_t size = st.st_size;
+  char *map = NULL;
+  if (size) {
+    map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+      builtin_error("%s: %s", path, strerror(errno));
+      close(fd);
+      return false;
+    }
+  }
+  const char *newline = map ? memchr(map, '\n', size) : NULL;
+  state->eol = newline && newline > map && newline[-1] == '\r' ? "\r\n" : "\n";
+  set_scan(state, map, size);
+  set_missing(state, map, size);
+
+  char *tmp_path = xmalloc(strlen(path) + 8);
+  sprintf(tmp_path, "%s.XXXXXX", path);
+  int tmp_fd = mkstemp(tmp_path);
+  bool ok = tmp_fd >= 0;
+  if (!ok) {
+    builtin_error("%s: %s", tmp_path, strerror(errno));
+  } else if (fchmod(tmp_fd, st.st_mode & 07777) != 0 ||
+             !set_write(state, tmp_fd, map, size) || fsync(tmp_fd) != 0) {
+    builtin_error("%s: write error: %s", tmp_path, strerror(errno));
+    ok = false;
+  }
+  if (tmp_fd >= 0 && close(tmp_fd) != 0 && ok) {
+    builtin_error("%s: %s", tmp_path, strerror(errno));
+    ok = false;
+  }
+  if (ok && rename(tmp_path, path) != 0) {
+    builtin_error("%s: %s", path, strerror(errno));
+    ok = false;
+  }
+  if (ok) {
+    set_sync_dir(path);
+  } else if (tmp_fd >= 0) {
+    unlink(tmp_path);
+  }
+  free(tmp_path);
+  if (map) {
+    munmap(map, size);
+  }
+  /* Closing releases the lock, after the rename */
+  close(fd);
+  return ok;
+}
+
+int ini_set_builtin(WORD_LIST *list) {
+  int opt;
+  char *path = NULL;
+  reset_internal_getopt();
+  while ((opt = internal_getopt(list, "f:")) != -1) {
+    switch (opt) {
+    case 'f':
+      path = list_optarg;
+      break;
+    case GETOPT_HELP:
+      builtin_help();
+      return EX_USAGE;
+    default:
+      builtin_usage();
+      return EX_USAGE;
+    }
+  }
+  if (!path) {
+    builtin_usage();
+    return EX_USAGE;
+  }
+  set_state state = {0};
+  if (!set_edits(&state, loptend)) {
+    set_free(&state);
+    return EX_USAGE;
+  }
+  bool ok = set_file(&state, path);
+  set_free(&state);
+  return ok ? EXECUTION_SUCCESS : EXECUTION_FAILURE;
+}
+
+/* Provides Bash with information about the builtin */
+struct builtin ini_set_struct = {
+    .name = "ini_set",              /* Builtin name */
+    .function = ini_set_builtin,    /* Function implementing the builtin */
+    .flags = BUILTIN_ENABLED,       /* Initial flags for builtin */
+    .long_doc = ini_set_doc,        /* Array of long documentation strings. */
+    .short_doc = "ini_set -f PATH SECTION KEY VALUE [SECTION KEY VALUE ...]",
+    .handle = 0                     /* Reserved for internal use */
+};
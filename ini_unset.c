@@ -0,0 +1,87 @@
+#include "builtins.h"
+#include "shell.h"
+#include "bashgetopt.h"
+#include "common.h"
+#include "ini_builtins.h"
+#include <stdbool.h>
+
+char *ini_unset_doc[] = {
+    "Removes the arrays made by `ini`.",
+    "",
+    "Unsets the `TOC` associative array and every array `ini -a TOC` made",
+    "for it, the `<TOC>_<INI_SECTION_NAME>` section arrays and the order,",
+    "integer, list and errors arrays. The arrays are those recorded by `ini`",
+    "as it made them, whatever the TOC lists now, so arrays of sections",
+    "dropped by a later parse are removed as well. Arrays that were already",
+    "unset are skipped, as are local arrays made by a function that has",
+    "returned, so a variable that has the name now is left alone.",
+    "",
+    "Fails if `ini` made no arrays for a `TOC` or if an array is readonly.",
+    NULL};
+
+/* Unsets the arrays made for one TOC, returns false if any is left */
+static bool unset_toc(const char *toc_var_name) {
+  HASH_TABLE *names = ini_registry_take(toc_var_name);
+  if (!names) {
+    builtin_error("%s: no arrays made by ini", toc_var_name);
+    return false;
+  }
+  bool ok = true;
+  for (int i = 0; i < names->nbuckets; i++) {
+    BUCKET_CONTENTS *item;
+    for (item = hash_items(i, names); item; item = item->next) {
+      /* A local array went with the function that made it, the name may
+       * now be another variable's */
+      SHELL_VAR *var = find_variable(item->key);
+      if (!var || var->context != *(int *)item->data) {
+        continue;
+      }
+      if (readonly_p(var) || noassign_p(var)) {
+        sh_readonly(item->key);
+        ok = false;
+        continue;
+      }
+      unbind_variable(item->key);
+    }
+  }
+  hash_flush(names, NULL);
+  hash_dispose(names);
+  return ok;
+}
+
+int ini_unset_builtin(WORD_LIST *list) {
+  int opt;
+  reset_internal_getopt();
+  while ((opt = internal_getopt(list, "")) != -1) {
+    switch (opt) {
+    case GETOPT_HELP:
+      builtin_help();
+      return EX_USAGE;
+    default:
+      builtin_usage();
+      return EX_USAGE;
+    }
+  }
+  list = loptend;
+  if (!list) {
+    builtin_usage();
+    return EX_USAGE;
+  }
+  int ret = EXECUTION_SUCCESS;
+  for (; list; list = list->next) {
+    if (!unset_toc(list->word->word)) {
+      ret = EXECUTION_FAILURE;
+    }
+  }
+  return ret;
+}
+
+/* Provides Bash with information about the builtin */
+struct builtin ini_unset_struct = {
+    .name = "ini_unset",            /* Builtin name */
+    .function = ini_unset_builtin,  /* Function implementing the builtin */
+    .flags = BUILTIN_ENABLED,       /* Initial flags for builtin */
+    .long_doc = ini_unset_doc,      /* Array of long documentation strings. */
+    .short_doc = "ini_unset TOC [TOC ...]", /* Usage synopsis */
+    .handle = 0                     /* Reserved for internal use */
+};
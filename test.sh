@@ -45,3 +45,254 @@ function parse-config() {
 
 parse-config 'test.ini' 'local'
 parse-config 'test.ini' 'global'
+
+# re-parse into an existing TOC, stale keys are dropped
+ini -a conf <<'INI'
+[user]
+name = Alice
+[user]
+email = alice@example.com
+INI
+declare -p conf conf_user
+
+# a variable of another type is converted in place, not hidden
+converted_user=scalar
+ini -a converted <test.ini
+unset converted_user
+declare -p converted_user 2>/dev/null || echo converted in place
+
+# flat mode, section names need not be identifiers
+ini -F -s '::' -a flat <<'INI'
+[web-01.example.com]
+port = 80
+INI
+declare -p flat
+
+# file order index arrays
+ini -o -a ordered <test.ini
+declare -p ordered__order ordered_user__keys
+
+# callback mode, triples are passed in batches of two
+function print-triples() {
+	printf '%s.%s=%s\n' "$@"
+	printf -- '--\n'
+}
+ini -C print-triples -c 2 <test.ini
+
+# a callback may itself run ini while the outer config is being read
+function nested-ini() {
+	ini -a nested <test.ini
+	nested_keys+=("$2")
+}
+nested_keys=()
+ini -C nested-ini -c 1 <<'INI'
+[outer]
+first = 1
+second = 2
+third = 3
+INI
+echo "${nested_keys[*]}"
+
+# integer typed keys
+ini -T protocol.version=int -a typed <test.ini
+declare -p typed_protocol__int
+
+# schema validation collects every violation
+if ! ini -S test_schema.ini -e schema_errors -a validated <test.ini 2>/dev/null; then
+	declare -p schema_errors
+fi
+
+# check mode reports every error of every file
+if ! ini -n -e check_errors -f test.ini -f test_bad.ini; then
+	declare -p check_errors
+fi
+
+# continuation lines, quotes and escapes
+ini -m -a multi <<'INI'
+[cert]
+pem = -----BEGIN-----
+  YWJj
+  -----END-----
+quoted = "tab\tquote\" "
+INI
+declare -p multi_cert
+# an unterminated quote keeps its quote, even when the value fills the buffer
+{
+	printf '[s]\nk = "%s\n  y\n' "$(printf 'x%.0s' {1..253})"
+} | ini -m -a unterminated
+echo "${#unterminated_s[k]} ${unterminated_s[k]:0:2}"
+
+# layered files, the last value of a key wins
+ini -O -p layered_from -a layered -f test.ini -f test_overlay.ini
+declare -p layered_user layered_from
+ini -O -a orphaned -f test.ini -f <(echo orphan=1) 2>/dev/null ||
+	echo orphan rejected
+
+# include directives
+ini -a included -f test_include.ini
+declare -p included included_extra
+top_file=$(mktemp)
+echo top=1 >"$top_file"
+printf '[main]\n!include %s\n' "$top_file" | ini -a top 2>/dev/null ||
+	echo top rejected
+rm -f "$top_file"
+
+# references to other keys and to shell variables
+app=blog
+ini -R -a interp <<'INI'
+[paths]
+logs = ${paths:root}/logs
+root = /srv/${app}
+price = $$5
+INI
+declare -p interp_paths
+
+# section inheritance
+ini -i -a hosts <<'INI'
+[web01 : web]
+name = web01
+
+[web]
+name = web
+port = 80
+INI
+declare -p hosts_web01
+
+# list values, split on a delimiter or collected from KEY[] lines
+ini -r -d ',' -l cluster.nodes -a lists <<'INI'
+[cluster]
+nodes = n0
+nodes = n1, n2,n3
+dns[] = 1.1.1.1
+dns[] = 8.8.8.8
+INI
+declare -p lists_cluster_nodes lists_cluster_dns
+
+# export mode, already exported variables override the config with -E
+ini -x -P blog -f test.ini
+declare -p BLOG_PROTOCOL_VERSION BLOG_USER_EMAIL
+export BLOG_USER_NAME='Carol Smith'
+ini -x -E -P blog -a exported <test.ini
+declare -p BLOG_USER_NAME exported_user
+
+# write the arrays back out as INI
+enable -f ./ini.so ini_dump
+ini -o -a dumped <test.ini
+ini_dump -o -a dumped
+# values are quoted and escaped so that -m reads them back as they were
+ini -m -a tricky <<'INI'
+[s]
+lead = "  padded  "
+comment = "a \; b"
+semi = ";first"
+blank = "one\n\ntwo"
+INI
+ini -m -a retricky < <(ini_dump -a tricky)
+declare -p retricky_s
+
+# edit a copy of the config in place, keeping its comments and spacing
+enable -f ./ini.so ini_set
+edited=$(mktemp)
+cp test.ini "$edited"
+ini_set -f "$edited" user name 'Carol Smith' user shell /bin/bash \
+  server port 8080
+cat "$edited"
+ini_set -f "$edited" quoted note $' padded ;\nnext'
+ini -m -a reread <"$edited"
+declare -p reread_quoted
+rm -f "$edited"
+
+# compare two configs
+enable -f ./ini.so ini_diff
+ini -a before <test.ini
+ini -a after <<'INI'
+[protocol]
+version=7
+[server]
+port=8080
+[user]
+name = Bob Smith
+email = bob@smith.com
+active = false
+INI
+ini_diff before after changes
+declare -p changes
+# flat TOCs are compared by their values
+ini -F -a flat_before <test.ini
+ini -F -a flat_after <test.ini
+flat_after[user.pi]=3
+ini_diff flat_before flat_after flat_changes
+declare -p flat_changes
+
+# hash the config, the content hash ignores order, comments and spacing
+ini -a hashed -H hashes <test.ini
+declare -p hashes
+ini -a reordered -H rehashes <<'INI'
+[user]
+pi=3.14159
+active=true
+email=bob@smith.com
+name=Bob Smith
+[protocol]
+version=6
+INI
+[[ ${rehashes[content]} == "${hashes[content]}" ]] && echo same content
+
+# a failed transactional parse leaves the previous arrays as they were
+ini -t -a txn -H txn_hashes <test.ini
+kept_hash=${txn_hashes[content]}
+ini -t -a txn -H txn_hashes <<'INI' || echo parse failed
+[protocol]
+version=7
+[bad-name]
+key=value
+INI
+declare -p txn txn_protocol
+[[ ${txn_hashes[content]} == "$kept_hash" ]] && echo hashes kept
+
+# remove every array a parse made in one call
+enable -f ./ini.so ini_unset
+ini -o -a gone <test.ini
+ini_unset gone
+declare -p gone gone_user gone__order 2>/dev/null || echo all unset
+ini -t -a kept <<'INI' 2>/dev/null || true
+[new]
+key=value
+[bad-name]
+INI
+kept_new=mine
+ini_unset kept 2>/dev/null || echo "$kept_new"
+load_scoped() { ini -a scoped <test.ini; }
+load_scoped
+scoped_user=global
+ini_unset scoped
+echo "$scoped_user"
+
+# read the config on a thread and make the arrays later
+enable -f ./ini.so ini_wait
+ini -A job -f test.ini
+ini_wait job -a waited
+declare -p waited_user
+
+# gzip input is decompressed as it is read
+gz_file=$(mktemp)
+gzip -c test.ini >"$gz_file"
+ini -a gz -f "$gz_file"
+rm -f "$gz_file"
+declare -p gz_user
+
+# lowercase names and keep only the keys matching a glob
+ini -L -k 'n*' -a lower <<'INI'
+[User]
+Name = Bob
+Email = bob@smith.com
+INI
+declare -p lower lower_user
+
+# mangle section names that are not legal in variable names
+ini -M -a hosts <<'INI'
+[web-01.example.com]
+port = 8080
+INI
+declare -p hosts hosts_web_01_example_com
+ini_dump -a hosts